@@ -0,0 +1,503 @@
+/*
+ * File: bench/harness.c
+ *
+ * Scalability regression harness. Runs each workload across a sweep of
+ * thread counts, reading hardware counters around every run, and writes
+ * one CSV row per configuration. Given a baseline CSV, flags
+ * configurations that have become slower or less cache friendly.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "../stm.h"
+
+
+#define MAX_THREADS 256
+#define NUM_COUNTERS 4
+#define NUM_KEYS 4096
+#define MAX_LINE 512
+
+
+/*
+ * workload_t: A named workload. setup builds the shared structures for one
+ * run, op performs one transaction's worth of operations and teardown frees
+ * what setup built.
+ */
+typedef struct {
+    const char *name;
+    void *(*setup)();
+    bool (*op)(transaction_t transaction, void *shared, unsigned int *seed);
+    void (*teardown)(void *shared);
+} workload_t;
+
+
+/*
+ * result_t: Measurements of one workload at one thread count.
+ */
+typedef struct {
+    char workload[64];
+    int threads;
+    double seconds;
+    unsigned long commits;
+    unsigned long aborts;
+    long long counters[NUM_COUNTERS];  // -1 where a counter is unavailable.
+} result_t;
+
+
+static const char *counter_names[NUM_COUNTERS] = {"cycles", "instructions", "llc_misses", "cache_misses"};
+
+static volatile bool _stop;
+
+
+// Workloads
+
+
+/*
+ * single_atom: Every thread increments one shared atom; the worst case for
+ * contention on a single cache line.
+ */
+typedef struct {
+    long value;
+    atom_t atom;
+} single_atom_t;
+
+
+static void *single_atom_setup() {
+    single_atom_t *shared = g_new(single_atom_t, 1);
+    shared->value = 0;
+    shared->atom = atomize(&shared->value, sizeof(long));
+    return shared;
+}
+
+
+static bool single_atom_op(transaction_t transaction, void *shared, unsigned int *seed) {
+    single_atom_t *single = (single_atom_t *) shared;
+    long value;
+    if(!transaction_read(transaction, &single->atom, &value))
+        return false;
+    value++;
+    return transaction_write(transaction, &single->atom, &value);
+}
+
+
+static void *counter_setup() {
+    return stm_counter_new(64);
+}
+
+
+static bool counter_op(transaction_t transaction, void *shared, unsigned int *seed) {
+    return stm_counter_add(transaction, (stm_counter_t *) shared, 1);
+}
+
+
+static void counter_teardown(void *shared) {
+    stm_counter_free((stm_counter_t *) shared);
+}
+
+
+static void *queue_setup() {
+    return stm_queue_new();
+}
+
+
+static bool queue_op(transaction_t transaction, void *shared, unsigned int *seed) {
+    void *value;
+    bool found;
+    return stm_queue_push(transaction, (stm_queue_t *) shared, (void *) (uintptr_t) rand_r(seed))
+        && stm_queue_pop(transaction, (stm_queue_t *) shared, &value, &found);
+}
+
+
+static void queue_teardown(void *shared) {
+    stm_queue_free((stm_queue_t *) shared);
+}
+
+
+static void *map_setup() {
+    return stm_map_new(64);
+}
+
+
+// 80% lookups, 20% updates over a fixed key space.
+static bool map_op(transaction_t transaction, void *shared, unsigned int *seed) {
+    uint64_t key = rand_r(seed) % NUM_KEYS;
+    void *value;
+    bool found;
+    if(rand_r(seed) % 5 == 0)
+        return stm_map_put(transaction, (stm_map_t *) shared, key, (void *) (uintptr_t) key);
+    return stm_map_get(transaction, (stm_map_t *) shared, key, &value, &found);
+}
+
+
+static void map_teardown(void *shared) {
+    stm_map_free((stm_map_t *) shared);
+}
+
+
+static void *skiplist_setup() {
+    return stm_skiplist_new();
+}
+
+
+static bool skiplist_op(transaction_t transaction, void *shared, unsigned int *seed) {
+    uint64_t key = rand_r(seed) % NUM_KEYS;
+    void *value;
+    bool found;
+    if(rand_r(seed) % 5 == 0)
+        return stm_skiplist_put(transaction, (stm_skiplist_t *) shared, key, (void *) (uintptr_t) key);
+    return stm_skiplist_get(transaction, (stm_skiplist_t *) shared, key, &value, &found);
+}
+
+
+static void skiplist_teardown(void *shared) {
+    stm_skiplist_free((stm_skiplist_t *) shared);
+}
+
+
+static workload_t workloads[] = {
+    {"single_atom", single_atom_setup, single_atom_op, g_free},
+    {"counter", counter_setup, counter_op, counter_teardown},
+    {"queue", queue_setup, queue_op, queue_teardown},
+    {"map", map_setup, map_op, map_teardown},
+    {"skiplist", skiplist_setup, skiplist_op, skiplist_teardown},
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+
+// Hardware counters
+
+
+static long perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu, int group_fd, unsigned long flags) {
+    return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+
+/*
+ * counters_open: Open every counter for this process and the threads it
+ * creates from now on. Unavailable counters get a descriptor of -1.
+ */
+static void counters_open(int *fds) {
+    static const uint32_t types[NUM_COUNTERS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE
+    };
+    static const uint64_t configs[NUM_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_MISSES
+    };
+    for(int i = 0; i < NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fds[i] = (int) perf_event_open(&attr, 0, -1, -1, 0);
+        if(fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+    }
+}
+
+
+static void counters_enable(int *fds, bool enable) {
+    for(int i = 0; i < NUM_COUNTERS; i++) {
+        if(fds[i] >= 0)
+            ioctl(fds[i], enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+    }
+}
+
+
+/*
+ * counters_close: Read and close every counter. Counts of threads that have
+ * exited are included, as they are inherited back into this process.
+ */
+static void counters_close(int *fds, long long *values) {
+    for(int i = 0; i < NUM_COUNTERS; i++) {
+        values[i] = -1;
+        if(fds[i] < 0)
+            continue;
+        if(read(fds[i], &values[i], sizeof(values[i])) != sizeof(values[i]))
+            values[i] = -1;
+        close(fds[i]);
+    }
+}
+
+
+// Running workloads
+
+
+typedef struct {
+    workload_t *workload;
+    void *shared;
+    unsigned int seed;
+} worker_t;
+
+
+/*
+ * worker_run: Run transactions of a workload until told to stop, retrying
+ * each one with a new transaction until it commits, as the transaction
+ * macros do.
+ */
+static void *worker_run(void *arg) {
+    worker_t *worker = (worker_t *) arg;
+    while(!_stop) {
+        for(;;) {
+            transaction_t transaction = transaction_new("bench");
+            if(worker->workload->op(transaction, worker->shared, &worker->seed)
+                    && !transaction_commit(transaction))
+                break;
+            transaction_abort(transaction);  // Frees it and backs off.
+        }
+    }
+    return NULL;
+}
+
+
+static double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+/*
+ * run_config: Run one workload with a number of threads for duration_ms
+ * milliseconds and measure it.
+ */
+static result_t run_config(workload_t *workload, int threads, int duration_ms) {
+    pthread_t ids[MAX_THREADS];
+    worker_t workers[MAX_THREADS];
+    int fds[NUM_COUNTERS];
+    struct timespec duration = {duration_ms / 1000, (duration_ms % 1000) * 1000000L};
+    result_t result;
+    stm_stats_t before, after;
+    double start;
+
+    memset(&result, 0, sizeof(result));
+    snprintf(result.workload, sizeof(result.workload), "%s", workload->name);
+    result.threads = threads;
+    void *shared = workload->setup();
+
+    _stop = false;
+    before = stm_get_stats();
+    counters_open(fds);
+    counters_enable(fds, true);
+    start = now_seconds();
+    for(int i = 0; i < threads; i++) {
+        workers[i].workload = workload;
+        workers[i].shared = shared;
+        workers[i].seed = (unsigned int) i * 2654435761u + 1;
+        pthread_create(&ids[i], NULL, worker_run, &workers[i]);
+    }
+    nanosleep(&duration, NULL);
+    _stop = true;
+    for(int i = 0; i < threads; i++)
+        pthread_join(ids[i], NULL);
+    result.seconds = now_seconds() - start;
+    counters_enable(fds, false);
+    counters_close(fds, result.counters);
+    after = stm_get_stats();
+
+    result.commits = after.commits - before.commits;
+    result.aborts = after.aborts - before.aborts;
+    workload->teardown(shared);
+    return result;
+}
+
+
+// CSV output and comparison
+
+
+static void csv_header(FILE *out) {
+    fprintf(out, "workload,threads,seconds,commits,aborts,commits_per_sec");
+    for(int i = 0; i < NUM_COUNTERS; i++)
+        fprintf(out, ",%s,%s_per_commit", counter_names[i], counter_names[i]);
+    fprintf(out, "\n");
+}
+
+
+static double per_commit(result_t *result, int counter) {
+    if(result->counters[counter] < 0 || result->commits == 0)
+        return -1;
+    return (double) result->counters[counter] / result->commits;
+}
+
+
+static void csv_row(FILE *out, result_t *result) {
+    fprintf(out, "%s,%d,%.3f,%lu,%lu,%.1f", result->workload, result->threads, result->seconds,
+            result->commits, result->aborts, result->commits / result->seconds);
+    for(int i = 0; i < NUM_COUNTERS; i++)
+        fprintf(out, ",%lld,%.2f", result->counters[i], per_commit(result, i));
+    fprintf(out, "\n");
+}
+
+
+// Next CSV field of the line being parsed, or "0" if it is missing.
+static const char *next_field() {
+    const char *field = strtok(NULL, ",");
+    return field != NULL ? field : "0";
+}
+
+
+/*
+ * csv_load: Read rows written by csv_row back into results.
+ * Returns the number of rows read, or -1 if the file cannot be opened.
+ */
+static int csv_load(const char *path, result_t *results, int max_results) {
+    FILE *in = fopen(path, "r");
+    char line[MAX_LINE];
+    int count = 0;
+    if(in == NULL)
+        return -1;
+    if(fgets(line, sizeof(line), in) == NULL) {  // Skip header.
+        fclose(in);
+        return 0;
+    }
+    while(count < max_results && fgets(line, sizeof(line), in) != NULL) {
+        result_t *result = &results[count];
+        char *field = strtok(line, ",");
+        if(field == NULL)
+            continue;
+        snprintf(result->workload, sizeof(result->workload), "%s", field);
+        result->threads = atoi(next_field());
+        result->seconds = atof(next_field());
+        result->commits = strtoul(next_field(), NULL, 10);
+        result->aborts = strtoul(next_field(), NULL, 10);
+        next_field();  // commits_per_sec is derived.
+        for(int i = 0; i < NUM_COUNTERS; i++) {
+            result->counters[i] = atoll(next_field());
+            next_field();
+        }
+        if(result->seconds <= 0)
+            continue;
+        count++;
+    }
+    fclose(in);
+    return count;
+}
+
+
+/*
+ * compare: Flag a result against its baseline if throughput dropped, or a
+ * per-commit counter rose, by more than tolerance (a fraction).
+ * Returns true if a regression was found.
+ */
+static bool compare(result_t *baseline, result_t *current, double tolerance) {
+    bool regressed = false;
+    double base_rate = baseline->commits / baseline->seconds;
+    double rate = current->commits / current->seconds;
+    if(rate < base_rate * (1 - tolerance)) {
+        printf("REGRESSION %s threads=%d commits_per_sec %.1f -> %.1f (%+.1f%%)\n", current->workload,
+               current->threads, base_rate, rate, 100 * (rate / base_rate - 1));
+        regressed = true;
+    }
+    for(int i = 0; i < NUM_COUNTERS; i++) {
+        double base_value = per_commit(baseline, i), value = per_commit(current, i);
+        if(base_value <= 0 || value < 0)
+            continue;
+        if(value > base_value * (1 + tolerance)) {
+            printf("REGRESSION %s threads=%d %s_per_commit %.2f -> %.2f (%+.1f%%)\n", current->workload,
+                   current->threads, counter_names[i], base_value, value, 100 * (value / base_value - 1));
+            regressed = true;
+        }
+    }
+    return regressed;
+}
+
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-t max_threads] [-d duration_ms] [-w workload] [-o out.csv]\n"
+            "          [-c baseline.csv] [-r tolerance_percent]\n"
+            "Threads are swept in powers of two below max_threads, then max_threads.\n"
+            "Workloads: single_atom, counter, queue, map, skiplist (default all).\n",
+            name);
+}
+
+
+int main(int argc, char **argv) {
+    int max_threads = (int) sysconf(_SC_NPROCESSORS_ONLN), duration_ms = 1000, opt;
+    const char *only = NULL, *out_path = NULL, *baseline_path = NULL;
+    double tolerance = 0.1;
+    FILE *out = stdout;
+    result_t *baseline = NULL;
+    int num_baseline = 0;
+    bool regressed = false, counters_warned = false;
+    int sweep[MAX_THREADS], num_sweep = 0;
+
+    while((opt = getopt(argc, argv, "t:d:w:o:c:r:h")) != -1) {
+        switch(opt) {
+        case 't': max_threads = atoi(optarg); break;
+        case 'd': duration_ms = atoi(optarg); break;
+        case 'w': only = optarg; break;
+        case 'o': out_path = optarg; break;
+        case 'c': baseline_path = optarg; break;
+        case 'r': tolerance = atof(optarg) / 100; break;
+        default: usage(argv[0]); return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if(max_threads < 1 || max_threads > MAX_THREADS || duration_ms < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if(baseline_path != NULL) {
+        baseline = g_new(result_t, NUM_WORKLOADS * 64);
+        num_baseline = csv_load(baseline_path, baseline, NUM_WORKLOADS * 64);
+        if(num_baseline < 0) {
+            fprintf(stderr, "Error: Could not read baseline %s\n", baseline_path);
+            return EXIT_FAILURE;
+        }
+    }
+    if(out_path != NULL && (out = fopen(out_path, "w")) == NULL) {
+        fprintf(stderr, "Error: Could not write %s\n", out_path);
+        return EXIT_FAILURE;
+    }
+
+    // Powers of two below max_threads, then max_threads itself.
+    for(int threads = 1; threads < max_threads; threads *= 2)
+        sweep[num_sweep++] = threads;
+    sweep[num_sweep++] = max_threads;
+
+    stm_init();
+    csv_header(out);
+    for(size_t w = 0; w < NUM_WORKLOADS; w++) {
+        if(only != NULL && strcmp(only, workloads[w].name))
+            continue;
+        for(int s = 0; s < num_sweep; s++) {
+            int threads = sweep[s];
+            result_t result = run_config(&workloads[w], threads, duration_ms);
+            if(result.counters[0] < 0 && !counters_warned) {
+                fprintf(stderr, "Warning: hardware counters unavailable; check perf_event_paranoid\n");
+                counters_warned = true;
+            }
+            csv_row(out, &result);
+            fflush(out);
+            for(int i = 0; i < num_baseline; i++) {
+                if(!strcmp(baseline[i].workload, result.workload) && baseline[i].threads == threads)
+                    regressed |= compare(&baseline[i], &result, tolerance);
+            }
+        }
+    }
+
+    if(out != stdout)
+        fclose(out);
+    g_free(baseline);
+    return regressed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -14,6 +14,15 @@
 #include <pthread.h>
 
 
+/*
+ * report_write: Print the value a transaction wrote. Run as a commit hook,
+ * so it only prints once the value has been committed.
+ */
+void report_write(void *value) {
+    printf("wrote %d\n", *(int *) value);
+}
+
+
 /*
  * th_run: Run an example transaction.
  *
@@ -34,9 +43,11 @@ void *th_run(void *at) {
         *z = 1;
     else
         *z = 2;
-    WriteAtom(*atom, z, trans);
+    WriteAtom(*atom, z, int, trans);
+    stm_on_commit(report_write, z, trans);  // Registered before stm_free, so runs first.
     stm_free(z, trans);
     EndTransaction(trans);
+    return NULL;
 }
 
 
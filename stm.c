@@ -11,14 +11,31 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <glib.h>
-#define __STDC_WANT_LIB_EXT1__ 1
 #include <string.h>
 #include "stm.h"
 
 
 int _stm_global_clock;
-pthread_mutex_t _stm_gc_lock;
+
+// Minimum size of each block of a transaction's log.
+#define STM_LOG_BLOCK_SIZE 4096
+#define STM_LOG_ALIGN 16
+
+// This thread's flush hook, how many commits it covers, and the commits since it last ran.
+static __thread stm_hook_t _stm_flush_hook = {NULL, NULL};
+static __thread int _stm_flush_batch = 1;
+static __thread int _stm_pending_commits = 0;
+
+// Lower bound on the read version of each thread's running transaction, or
+// INT_MAX between transactions. Registered globally so the oldest can be found,
+// and so the adaptive controller can tell when none are running.
+static __thread int *_stm_thread_version = NULL;
+static GSList *_stm_all_versions = NULL;
+static pthread_mutex_t _stm_versions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t _stm_versions_key;
+static pthread_once_t _stm_versions_once = PTHREAD_ONCE_INIT;
 
 
 // Atom functions
@@ -76,6 +93,19 @@ int atom_get_version(atom_t atom) {
 }
 
 
+/*
+ * atom_check_size: Exit if a value of a type with the given size is read from
+ * or written to an atom of a different size, as ReadAtom and WriteAtom
+ * always copy the whole atom.
+ */
+void atom_check_size(atom_t *atom, size_t size) {
+    if(size != atom->size) {
+        printf("Error: Invalid operation between conflicting types");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
 // read_op functions
 
 
@@ -114,7 +144,8 @@ bool read_op_validate(read_op_t *read_op) {
  * Will not validate the read.
  */
 void *read_op_read(read_op_t read_op) {
-    read_op.dest = read_op.atom->address;
+    memcpy(read_op.dest, read_op.atom->address, read_op.atom->size);
+    return read_op.dest;
 }
 
 
@@ -130,6 +161,7 @@ write_op_t write_op_new(atom_t *atom, void *src, int version_number, size_t src_
     write_op.src = src;
     write_op.version_number = version_number;
     write_op.src_size = src_size;
+    write_op.offset = 0;
     if(src_size != atom->size) {
         printf("Error: Invalid write operation between conflicting types");
         exit(EXIT_FAILURE);
@@ -138,6 +170,25 @@ write_op_t write_op_new(atom_t *atom, void *src, int version_number, size_t src_
 }
 
 
+/*
+ * write_op_new_range: Creates a write operation covering only src_size bytes
+ * of an atom, starting at offset.
+ */
+write_op_t write_op_new_range(atom_t *atom, size_t offset, void *src, int version_number, size_t src_size) {
+    write_op_t write_op;
+    write_op.atom = atom;
+    write_op.src = src;
+    write_op.version_number = version_number;
+    write_op.src_size = src_size;
+    write_op.offset = offset;
+    if(offset > atom->size || src_size > atom->size - offset) {
+        printf("Error: Write operation out of range of atom");
+        exit(EXIT_FAILURE);
+    }
+    return write_op;
+}
+
+
 /*
  * write_op_validate: Checks if a write operation is still valid.
  * Returns True if so, False otherwise.
@@ -146,7 +197,7 @@ write_op_t write_op_new(atom_t *atom, void *src, int version_number, size_t src_
  */
 bool write_op_validate(write_op_t *write_op) {
     // Valid if atom version is below transaction version.
-    bool result = write_op->version_number >= atom_get_version(*(write_op->atom));
+    return write_op->version_number >= atom_get_version(*(write_op->atom));
 }
 
 
@@ -156,7 +207,8 @@ bool write_op_validate(write_op_t *write_op) {
  * Does not validate the write operation.
  */
 void write_op_write(write_op_t write_op) {
-    memcpy_s(write_op.atom->address, write_op.atom->size, write_op.src, write_op.src_size);
+    // The range was checked against the atom's size when the operation was made.
+    memcpy((char *) write_op.atom->address + write_op.offset, write_op.src, write_op.src_size);
 }
 
 
@@ -165,12 +217,9 @@ void write_op_write(write_op_t write_op) {
 
 /*
  * new_readset: Creates an empty read set.
- *
- * No initialization needed currently, but this method is kept in case needed later.
  */
-readset_t new_readset() {
-    readset_t readset;
-    return readset;
+readset_t *new_readset() {
+    return g_new0(readset_t, 1);
 }
 
 
@@ -179,8 +228,9 @@ readset_t new_readset() {
  *
  * Will not validate this read.
  */
-void readset_append(readset_t readset, read_op_t *read_op) {
-    readset.read_ops = g_slist_prepend(readset.read_ops, (gpointer) read_op);
+void readset_append(readset_t *readset, read_op_t *read_op) {
+    readset->read_ops = g_slist_prepend(readset->read_ops, (gpointer) read_op);
+    readset->num_read_ops++;
 }
 
 
@@ -190,10 +240,10 @@ void readset_append(readset_t readset, read_op_t *read_op) {
  *
  * Is to be used right after appending a read operation.
  */
-bool readset_validate_last_read(readset_t readset) {
-    if(readset.num_read_ops == 0)
+bool readset_validate_last_read(readset_t *readset) {
+    if(readset->num_read_ops == 0)
         return true;
-    return read_op_validate((read_op_t *) readset.read_ops->data);
+    return read_op_validate((read_op_t *) readset->read_ops->data);
 }
 
 
@@ -201,24 +251,35 @@ bool readset_validate_last_read(readset_t readset) {
  * readset_validate_all: Check whether all reads are valid.
  * Returns True if all are valid, False otherwise.
  *
+ * Atoms in the locked write set are already held by the caller, so their
+ * versions are checked directly rather than by trying their locks.
+ *
  * Is to be used at commit of transaction.
  */
-bool readset_validate_all(readset_t readset) {
-    GSList *current = readset.read_ops;
+bool readset_validate_all(readset_t *readset, writeset_t *locked) {
+    GSList *current = readset->read_ops;
     for(; current != NULL; current = current->next) {
-        if(!read_op_validate((read_op_t *) current->data))
+        read_op_t *read_op = (read_op_t *) current->data;
+        if(writeset_contains(locked, read_op->atom)) {
+            if(read_op->version_number < atom_get_version(*(read_op->atom)))
+                return false;
+        } else if(!read_op_validate(read_op)) {
             return false;
+        }
     }
     return true;
 }
 
 
 /*
- * readset_free_ops: Frees memory of all read operations in set.
- * The read set can then be freed in the standard free(set) fashion.
+ * readset_free_ops: Frees the list of read operations in set. The operations
+ * themselves live in the transaction's log.
+ * The read set can then be freed in the standard g_free(set) fashion.
  */
-void readset_free_ops(readset_t readset) {
-    g_slist_free(readset.read_ops);
+void readset_free_ops(readset_t *readset) {
+    g_slist_free(readset->read_ops);
+    readset->read_ops = NULL;
+    readset->num_read_ops = 0;
 }
 
 
@@ -227,12 +288,9 @@ void readset_free_ops(readset_t readset) {
 
 /*
  * new_writeset: Create a new empty write set.
- *
- * No initialization currently needed; this method is kept in case this changes.
  */
-writeset_t new_writeset() {
-    writeset_t writeset;
-    return writeset;
+writeset_t *new_writeset() {
+    return g_new0(writeset_t, 1);
 }
 
 
@@ -241,8 +299,47 @@ writeset_t new_writeset() {
  *
  * Does not validate this operation.
  */
-void writeset_append(writeset_t writeset, write_op_t *write_op) {
-    writeset.write_ops = g_slist_prepend(writeset.write_ops, (gpointer) write_op);
+void writeset_append(writeset_t *writeset, write_op_t *write_op) {
+    GSList *ops = NULL;
+    if(writeset->atoms == NULL)
+        writeset->atoms = g_hash_table_new(g_direct_hash, g_direct_equal);
+    else
+        ops = g_hash_table_lookup(writeset->atoms, write_op->atom);
+    if(ops == NULL)
+        writeset->atom_list = g_slist_prepend(writeset->atom_list, write_op->atom);
+    g_hash_table_insert(writeset->atoms, write_op->atom, g_slist_prepend(ops, write_op));
+    writeset->last_write = write_op;
+    writeset->num_write_ops++;
+}
+
+
+/*
+ * writeset_contains: Whether any write operation in the set targets an atom.
+ */
+bool writeset_contains(writeset_t *writeset, atom_t *atom) {
+    return writeset->atoms != NULL && g_hash_table_contains(writeset->atoms, atom);
+}
+
+
+/*
+ * writeset_atom_ops: The write operations on an atom that reach it at commit,
+ * in the order they were made. Writes before the most recent whole write of
+ * the atom are left out, as it replaces them.
+ *
+ * The returned list must be freed with g_slist_free.
+ */
+GSList *writeset_atom_ops(writeset_t *writeset, atom_t *atom) {
+    GSList *result = NULL, *current;
+    if(writeset->atoms == NULL)
+        return NULL;
+    current = g_hash_table_lookup(writeset->atoms, atom);
+    for(; current != NULL; current = current->next) {
+        write_op_t *write_op = (write_op_t *) current->data;
+        result = g_slist_prepend(result, write_op);
+        if(write_op->offset == 0 && write_op->src_size == atom->size)
+            break;
+    }
+    return result;
 }
 
 
@@ -252,9 +349,11 @@ void writeset_append(writeset_t writeset, write_op_t *write_op) {
  *
  * Is to be used right after appending a write operation.
  */
-bool writeset_validate_last_write(writeset_t writeset) {
+bool writeset_validate_last_write(writeset_t *writeset) {
+    if(writeset->num_write_ops == 0)
+        return true;
     // Valid if atom version is below transaction version.
-    write_op_t *write_op = writeset.write_ops->data;
+    write_op_t *write_op = writeset->last_write;
     if(!atom_lock_attempt(write_op->atom)) {
         bool result = write_op_validate(write_op);
         atom_unlock(write_op->atom);
@@ -266,16 +365,20 @@ bool writeset_validate_last_write(writeset_t writeset) {
 
 
 /*
- * writeset_lock: Locks all atoms to be written to by set's write operations.
- * If any locks fail, a nonzero value is returned rather than retrying.
+ * writeset_lock: Locks each atom to be written to by set's write operations.
+ * If any locks fail, the atoms locked so far are released and a nonzero value
+ * is returned rather than retrying.
  *
  * To be used at commit of transaction.
  */
-int writeset_lock(writeset_t writeset) {
-    for(GSList *current = writeset.write_ops; current != NULL; current = current->next) {
-        write_op_t *cur_op = (write_op_t *) current->data;
-        int result = atom_lock_attempt(cur_op->atom);
-        if(result) return result;
+int writeset_lock(writeset_t *writeset) {
+    for(GSList *current = writeset->atom_list; current != NULL; current = current->next) {
+        int result = atom_lock_attempt((atom_t *) current->data);
+        if(result) {
+            for(GSList *locked = writeset->atom_list; locked != current; locked = locked->next)
+                atom_unlock((atom_t *) locked->data);
+            return result;
+        }
     }
     return 0;
 }
@@ -284,21 +387,23 @@ int writeset_lock(writeset_t writeset) {
 /*
  * writeset_unlock: Unlocks all atoms to be written to by set's write operations.
  */
-void writeset_unlock(writeset_t writeset) {
-    for(GSList *current = writeset.write_ops; current != NULL; current = current->next)
-        atom_unlock(((write_op_t *) current->data)->atom);
+void writeset_unlock(writeset_t *writeset) {
+    for(GSList *current = writeset->atom_list; current != NULL; current = current->next)
+        atom_unlock((atom_t *) current->data);
 }
 
 
 /*
- * writeset_validate_all: Validates every write set operation.
+ * writeset_validate_all: Validates every written atom. All of a transaction's
+ * operations share its version number, so one check per atom is enough.
  *
  * Assumes writeset is already locked. To be used at commit.
  */
-bool writeset_validate_all(writeset_t writeset) {
-    GSList *current_node = writeset.write_ops;
+bool writeset_validate_all(writeset_t *writeset) {
+    GSList *current_node = writeset->atom_list;
     for(; current_node != NULL; current_node = current_node->next) {
-        if(!write_op_validate((write_op_t *) current_node->data))
+        GSList *ops = g_hash_table_lookup(writeset->atoms, current_node->data);
+        if(!write_op_validate((write_op_t *) ops->data))
             return false;
     }
     return true;
@@ -306,28 +411,106 @@ bool writeset_validate_all(writeset_t writeset) {
 
 
 /*
- * writeset_commit: Commits the write operations to all written atoms.
+ * writeset_commit: Commits the write operations to all written atoms,
+ * in the order they were made, so later writes to a range win, and gives
+ * each written atom the commit's version number.
  *
  * Assumes write set has already been locked.
  */
-void writeset_commit(writeset_t writeset) {
-    GSList *current_node = writeset.write_ops;
-    for(; current_node != NULL; current_node = current_node->next) {
-        write_op_write(*((write_op_t *) current_node->data));
+void writeset_commit(writeset_t *writeset, int version_number) {
+    GSList *current_atom = writeset->atom_list;
+    for(; current_atom != NULL; current_atom = current_atom->next) {
+        atom_t *atom = (atom_t *) current_atom->data;
+        GSList *ops = writeset_atom_ops(writeset, atom);
+        for(GSList *current_node = ops; current_node != NULL; current_node = current_node->next)
+            write_op_write(*((write_op_t *) current_node->data));
+        atom->vlock.version_number = version_number;
+        g_slist_free(ops);
     }
 }
 
 
 /*
- * writeset_free_ops: Frees all write operations in the write set.
+ * writeset_free_ops: Frees the lists of write operations in the write set.
+ * The operations and their values live in the transaction's log.
  *
- * After this, the write set itself can be freed with free(set) if need be.
+ * After this, the write set itself can be freed with g_free(set) if need be.
  */
-void writeset_free_ops(writeset_t writeset) {
-    GSList *current_node = writeset.write_ops;
-    for(; current_node != NULL; current_node = current_node->next) {
-        write_op_write(*((write_op_t *) current_node->data));
+void writeset_free_ops(writeset_t *writeset) {
+    GSList *current_atom = writeset->atom_list;
+    for(; current_atom != NULL; current_atom = current_atom->next)
+        g_slist_free(g_hash_table_lookup(writeset->atoms, current_atom->data));
+    if(writeset->atoms != NULL)
+        g_hash_table_destroy(writeset->atoms);
+    g_slist_free(writeset->atom_list);
+    writeset->atoms = NULL;
+    writeset->atom_list = NULL;
+    writeset->last_write = NULL;
+    writeset->num_write_ops = 0;
+}
+
+
+// Reclamation functions
+
+
+static void thread_version_release(void *slot) {
+    pthread_mutex_lock(&_stm_versions_lock);
+    _stm_all_versions = g_slist_remove(_stm_all_versions, slot);
+    pthread_mutex_unlock(&_stm_versions_lock);
+    g_free(slot);
+}
+
+
+static void thread_version_key_init() {
+    pthread_key_create(&_stm_versions_key, thread_version_release);
+}
+
+
+/*
+ * thread_version: Get this thread's version slot, registering it on first
+ * use. It is unregistered when the thread exits.
+ */
+static int *thread_version() {
+    if(_stm_thread_version == NULL) {
+        pthread_once(&_stm_versions_once, thread_version_key_init);
+        _stm_thread_version = g_new(int, 1);
+        *_stm_thread_version = INT_MAX;
+        pthread_mutex_lock(&_stm_versions_lock);
+        _stm_all_versions = g_slist_prepend(_stm_all_versions, _stm_thread_version);
+        pthread_mutex_unlock(&_stm_versions_lock);
+        pthread_setspecific(_stm_versions_key, _stm_thread_version);
     }
+    return _stm_thread_version;
+}
+
+
+/*
+ * stm_oldest_active_version: A version no greater than the read version of
+ * any transaction now running.
+ *
+ * Memory unlinked by a committed transaction, then stamped with the clock,
+ * can no longer be reached once this is above the stamp.
+ */
+int stm_oldest_active_version() {
+    int oldest = __atomic_load_n(&_stm_global_clock, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&_stm_versions_lock);
+    for(GSList *current = _stm_all_versions; current != NULL; current = current->next)
+        oldest = MIN(oldest, __atomic_load_n((int *) current->data, __ATOMIC_SEQ_CST));
+    pthread_mutex_unlock(&_stm_versions_lock);
+    return oldest;
+}
+
+
+/*
+ * _stm_transactions_idle: Whether no thread is inside a transaction.
+ */
+bool _stm_transactions_idle() {
+    bool idle = true;
+    pthread_mutex_lock(&_stm_versions_lock);
+    for(GSList *current = _stm_all_versions; current != NULL && idle; current = current->next)
+        idle = __atomic_load_n((int *) current->data, __ATOMIC_SEQ_CST) == INT_MAX;
+    pthread_mutex_unlock(&_stm_versions_lock);
+    return idle;
 }
 
 
@@ -339,8 +522,13 @@ void writeset_free_ops(writeset_t writeset) {
  */
 transaction_t transaction_new(char *name) {
     transaction_t trans;
+    // Published before the read version is taken, so it never exceeds it.
+    _stm_quiesce_enter(thread_version());
     trans.readset = new_readset();
     trans.writeset = new_writeset();
+    trans.log = g_new0(stm_log_t, 1);
+    trans.commit_hooks = g_queue_new();
+    trans.abort_hooks = g_queue_new();
     trans.buf_name = name;
     trans.version_number = stm_get_clock();
     return trans;
@@ -357,6 +545,147 @@ void transaction_add_read(transaction_t transaction, read_op_t *read_op) {
 }
 
 
+/*
+ * transaction_merge_range: Copy size bytes of the value a transaction sees
+ * for an atom, starting at offset, into dest.
+ *
+ * The atom's committed value is copied, then the transaction's writes to the
+ * atom that overlap the requested range are applied over it in the order
+ * they were made.
+ */
+static void transaction_merge_range(transaction_t transaction, atom_t *atom, size_t offset, void *dest, size_t size) {
+    GSList *ranges = writeset_atom_ops(transaction.writeset, atom);
+    memcpy(dest, (char *) atom->address + offset, size);
+    for(GSList *current = ranges; current != NULL; current = current->next) {
+        write_op_t *write_op = (write_op_t *) current->data;
+        size_t start = MAX(offset, write_op->offset);
+        size_t end = MIN(offset + size, write_op->offset + write_op->src_size);
+        if(start < end)
+            memcpy((char *) dest + (start - offset), (char *) write_op->src + (start - write_op->offset), end - start);
+    }
+    g_slist_free(ranges);
+}
+
+
+/*
+ * transaction_get_read: Get the value a transaction sees for an atom.
+ *
+ * This is the transaction's own most recent write to the atom if it has
+ * one, or the atom's committed value otherwise. If the atom has range writes
+ * since then, the merged value is built in the transaction's log.
+ */
+void *transaction_get_read(transaction_t transaction, atom_t *atom) {
+    if(!writeset_contains(transaction.writeset, atom))
+        return atom->address;
+    write_op_t *write_op = ((GSList *) g_hash_table_lookup(transaction.writeset->atoms, atom))->data;
+    if(write_op->offset == 0 && write_op->src_size == atom->size)
+        return write_op->src;
+    void *merged = transaction_log_alloc(transaction, atom->size);
+    transaction_merge_range(transaction, atom, 0, merged, atom->size);
+    return merged;
+}
+
+
+/*
+ * transaction_log_alloc: Allocate memory from the transaction's log.
+ *
+ * The memory is released when the transaction commits or aborts.
+ */
+void *transaction_log_alloc(transaction_t transaction, size_t size) {
+    stm_log_t *log = transaction.log;
+    size = (size + STM_LOG_ALIGN - 1) & ~(size_t) (STM_LOG_ALIGN - 1);
+    if(log->used + size > log->capacity) {
+        log->capacity = MAX(STM_LOG_BLOCK_SIZE, size);
+        log->blocks = g_slist_prepend(log->blocks, g_malloc(log->capacity));
+        log->used = 0;
+    }
+    void *result = (char *) log->blocks->data + log->used;
+    log->used += size;
+    return result;
+}
+
+
+/*
+ * transaction_log_clear: Release all memory in the transaction's log.
+ */
+static void transaction_log_clear(transaction_t transaction) {
+    g_slist_free_full(transaction.log->blocks, g_free);
+    transaction.log->blocks = NULL;
+    transaction.log->used = transaction.log->capacity = 0;
+}
+
+
+/*
+ * transaction_read: Function form of ReadAtom. Records a read of an atom and
+ * copies the value the transaction sees into dest.
+ *
+ * Returns false if the read is invalid and the transaction must abort.
+ */
+bool transaction_read(transaction_t transaction, atom_t *atom, void *dest) {
+    return transaction_read_range(transaction, atom, 0, dest, atom->size);
+}
+
+
+/*
+ * transaction_write: Function form of WriteAtom. Unlike WriteAtom, the value
+ * at src is copied into the transaction's log, so src need not outlive the call.
+ *
+ * Returns false if the write is invalid and the transaction must abort.
+ */
+bool transaction_write(transaction_t transaction, atom_t *atom, const void *src) {
+    void *copy = transaction_log_alloc(transaction, atom->size);
+    write_op_t *write_op = transaction_log_alloc(transaction, sizeof(write_op_t));
+    memcpy(copy, src, atom->size);
+    *write_op = write_op_new(atom, copy, transaction.version_number, atom->size);
+    transaction_add_write(transaction, write_op);
+    return transaction_validate_last_write(transaction);
+}
+
+
+/*
+ * transaction_read_range: Records a read of an atom and copies size bytes of
+ * the value the transaction sees, starting at offset, into dest.
+ *
+ * The version is checked and the value copied while the atom is locked, so a
+ * concurrent commit cannot change it in between.
+ *
+ * Returns false if the read is invalid and the transaction must abort.
+ */
+bool transaction_read_range(transaction_t transaction, atom_t *atom, size_t offset, void *dest, size_t size) {
+    if(offset > atom->size || size > atom->size - offset) {
+        printf("Error: Read operation out of range of atom");
+        exit(EXIT_FAILURE);
+    }
+    read_op_t *read_op = transaction_log_alloc(transaction, sizeof(read_op_t));
+    *read_op = read_op_new(atom, dest, transaction.version_number);
+    transaction_add_read(transaction, read_op);
+    if(atom_lock_attempt(atom))
+        return false;
+    bool valid = read_op->version_number >= atom_get_version(*atom);
+    if(valid)
+        transaction_merge_range(transaction, atom, offset, dest, size);
+    atom_unlock(atom);
+    return valid;
+}
+
+
+/*
+ * transaction_write_range: Writes size bytes from src into an atom, starting at
+ * offset. The bytes are copied into the transaction's log, and only this range
+ * is written back at commit.
+ *
+ * Returns false if the write is invalid and the transaction must abort.
+ */
+bool transaction_write_range(transaction_t transaction, atom_t *atom, size_t offset, const void *src, size_t size) {
+    void *copy = transaction_log_alloc(transaction, size);
+    write_op_t *write_op = transaction_log_alloc(transaction, sizeof(write_op_t));
+    memcpy(copy, src, size);
+    *write_op = write_op_new_range(atom, offset, copy, transaction.version_number, size);
+    transaction_add_write(transaction, write_op);
+    return transaction_validate_last_write(transaction);
+}
+
+
 /*
  * transaction_validate_last_read: Validates the most recent read operation in the transaction.
  *
@@ -393,29 +722,116 @@ bool transaction_validate_last_write(transaction_t transaction) {
  * This allows the transaction to free the allocated memory on abortion.
  */
 void *transaction_add_malloc(transaction_t transaction, size_t size) {
-    //
+    void *pnt = malloc(size);
+    transaction_add_abort_hook(transaction, free, pnt);
+    return pnt;
 }
 
 
 /*
- * transaction_add_free: Free pointer and remove record of memory being allocated within
- * transaction.
+ * transaction_add_free: Free malloc'd memory once the transaction commits.
  *
- * Does not work with memory allocated outside of transaction.
+ * Memory from transaction_add_malloc in the same transaction is freed either
+ * way, by this on commit or by the allocation's abort hook otherwise.
  */
 void transaction_add_free(transaction_t transaction, void *pnt) {
-    //
+    transaction_add_commit_hook(transaction, free, pnt);
+}
+
+
+/*
+ * transaction_add_commit_hook: Register an action to run once the transaction
+ * has committed and released its locks.
+ */
+void transaction_add_commit_hook(transaction_t transaction, stm_hook_fn fn, void *arg) {
+    stm_hook_t *hook = g_new(stm_hook_t, 1);
+    hook->fn = fn;
+    hook->arg = arg;
+    g_queue_push_tail(transaction.commit_hooks, hook);
+}
+
+
+/*
+ * transaction_add_abort_hook: Register an action to run if the transaction
+ * is rolled back.
+ */
+void transaction_add_abort_hook(transaction_t transaction, stm_hook_fn fn, void *arg) {
+    stm_hook_t *hook = g_new(stm_hook_t, 1);
+    hook->fn = fn;
+    hook->arg = arg;
+    g_queue_push_tail(transaction.abort_hooks, hook);
+}
+
+
+/*
+ * transaction_run_commit_hooks: Run a committed transaction's hooks in
+ * registration order, then this thread's flush hook if the commit completes
+ * a batch.
+ */
+static void transaction_run_commit_hooks(transaction_t transaction) {
+    stm_hook_t *hook;
+    while((hook = g_queue_pop_head(transaction.commit_hooks)) != NULL) {
+        hook->fn(hook->arg);
+        g_free(hook);
+    }
+    if(_stm_flush_hook.fn != NULL && ++_stm_pending_commits >= _stm_flush_batch)
+        stm_flush_hooks();
+}
+
+
+/*
+ * transaction_free: Release everything owned by a finished transaction.
+ */
+static void transaction_free(transaction_t transaction) {
+    readset_free_ops(transaction.readset);
+    writeset_free_ops(transaction.writeset);
+    g_free(transaction.readset);
+    g_free(transaction.writeset);
+    g_queue_free_full(transaction.abort_hooks, g_free);
+    g_queue_free_full(transaction.commit_hooks, g_free);
+    transaction_log_clear(transaction);
+    g_free(transaction.log);
+}
+
+
+/*
+ * transaction_leave: Mark the end of this thread's transaction, for
+ * reclamation and the adaptive controller.
+ */
+static void transaction_leave() {
+    __atomic_store_n(thread_version(), INT_MAX, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * transaction_abandon: End a transaction without committing it, for callers
+ * that will not retry it.
+ * Abort hooks are run in registration order, so stm_malloc'd memory is freed,
+ * and commit hooks are discarded. The transaction is freed and stops holding
+ * up the adaptive controller's quiescent point.
+ */
+void transaction_abandon(transaction_t transaction) {
+    stm_hook_t *hook;
+    while((hook = g_queue_pop_head(transaction.abort_hooks)) != NULL) {
+        hook->fn(hook->arg);
+        g_free(hook);
+    }
+    transaction_free(transaction);
+    transaction_leave();
 }
 
 
 /*
  * transaction_abort: Abort transaction, doing all cleanup needed.
- * This includes freeing read and write operations, along with stm_malloc'd memory.
+ * The transaction is abandoned, counted as an abort, and the thread backs off
+ * before a retry starts a new transaction.
  *
  * Is not responsible for returning to start of transaction.
  */
 void transaction_abort(transaction_t transaction) {
-    //
+    transaction_abandon(transaction);
+    _stm_stats_abort();
+    _stm_backoff();
 }
 
 
@@ -423,10 +839,37 @@ void transaction_abort(transaction_t transaction) {
  * transaction_commit: Commit all the writes of the transaction.
  *
  * Will do all locking, validating, commiting and unlocking of write set along with read set.
- * Returns a nonzero value if transaction commit fails.
+ * Written atoms take a new version from the global clock, so transactions that read
+ * them earlier fail validation.
+ * Durable writes are logged before they are applied, and the log is flushed after the write set
+ * is unlocked, so conflicting transactions are not held up by the flush. Commit hooks only run,
+ * and the commit only returns, once its writes are durable.
+ * The transaction is freed on success. Returns a nonzero value if transaction commit
+ * fails, in which case the caller should abort it.
  */
 int transaction_commit(transaction_t transaction) {
-    //
+    uint64_t lsn;
+    int write_version;
+    if(writeset_lock(transaction.writeset))
+        return 1;
+    // Taken under the locks, so readers see either the old version or this one.
+    write_version = stm_get_clock();
+    if(!writeset_validate_all(transaction.writeset) || !readset_validate_all(transaction.readset, transaction.writeset)) {
+        writeset_unlock(transaction.writeset);
+        return 1;
+    }
+    lsn = _stm_durable_log(transaction.writeset);
+    writeset_commit(transaction.writeset, write_version);
+    _stm_durable_applied(lsn);
+    writeset_unlock(transaction.writeset);
+    _stm_stats_commit();
+    transaction_leave();
+    // Durable transactions that read these writes log after them, so their waits cover them too.
+    _stm_durable_wait(lsn);
+
+    transaction_run_commit_hooks(transaction);
+    transaction_free(transaction);
+    return 0;
 }
 
 
@@ -434,16 +877,46 @@ int transaction_commit(transaction_t transaction) {
 
 
 void stm_init() {
-    pthread_mutex_init(&_stm_gc_lock, NULL);
+    __atomic_store_n(&_stm_global_clock, 0, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * stm_on_flush: Set this thread's flush hook, run once after every num_commits
+ * commits on the thread, following their commit hooks. Commits pending for the
+ * previous hook are flushed first. A NULL fn removes the hook.
+ */
+void stm_on_flush(stm_hook_fn fn, void *arg, int num_commits) {
+    stm_flush_hooks();
+    _stm_flush_hook.fn = fn;
+    _stm_flush_hook.arg = arg;
+    _stm_flush_batch = num_commits < 1 ? 1 : num_commits;
+}
+
+
+/*
+ * stm_flush_hooks: Run this thread's flush hook now if it has commits pending.
+ * Threads with a flush hook should call this before going idle or exiting, as
+ * the hook otherwise waits for the batch to fill.
+ *
+ * Transactions run by the flush hook itself are not counted towards the next batch.
+ */
+void stm_flush_hooks() {
+    stm_hook_t hook = _stm_flush_hook;
+    if(hook.fn == NULL || _stm_pending_commits == 0)
+        return;
+    _stm_pending_commits = 0;
+    _stm_flush_hook.fn = NULL;
+    hook.fn(hook.arg);
+    _stm_flush_hook = hook;
 }
 
 
+/*
+ * stm_get_clock: Take the current clock value and advance the clock.
+ */
 int stm_get_clock() {
-    pthread_mutex_lock(&_stm_gc_lock);
-    int result = _stm_global_clock;
-    _stm_global_clock++;
-    pthread_mutex_unlock(&_stm_gc_lock);
-    return result;
+    return __atomic_fetch_add(&_stm_global_clock, 1, __ATOMIC_SEQ_CST);
 }
 
 
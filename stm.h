@@ -10,7 +10,11 @@
 #define STM_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <pthread.h>
+#include <setjmp.h>
 #include <glib.h>
 
 /*
@@ -54,7 +58,9 @@
  * or a certain number of times before a complete erroneous shutdown.
  *
  * NB: Users should not use functions with side effects within the transaction,
- * nor should they spawn multiple threads. If heap memory allocation is needed,
+ * nor should they spawn multiple threads. Side effects that must follow the
+ * outcome of a transaction can instead be deferred with stm_on_commit and
+ * stm_on_abort (see below). If heap memory allocation is needed,
  * users should refer to stm_malloc, stm_realloc and stm_free. Declaring
  * variables within the transaction is also ill-advised.
  *
@@ -89,18 +95,66 @@ void atom_lock(atom_t *atom);
 int atom_lock_attempt(atom_t *atom);
 void atom_unlock(atom_t *atom);
 int atom_get_version(atom_t atom);
+void atom_check_size(atom_t *atom, size_t size);  // Exits if a whole value of size cannot fit the atom.
 
 
 /*
- * _stm_global_clock: Global clock and its respective mutex.
+ * _stm_global_clock: Global version clock. Only changed by stm_get_clock,
+ * and read and incremented atomically.
  */
 extern int _stm_global_clock;
-extern pthread_mutex_t _stm_gc_lock;
 
 
 // This function must be called at the start of the program.
 void stm_init();
 int stm_get_clock();
+int stm_oldest_active_version();  // For freeing memory transactions may still read.
+bool _stm_transactions_idle();     // For the adaptive controller's quiescent point.
+
+
+/*
+ * Adaptive tuning: an optional controller that samples per-thread commit
+ * and abort counts every interval and retunes retry backoff to match. It
+ * never changes hook batching, which decides when user side effects run.
+ *
+ * Changes are applied at a global quiescent point: the thread that notices
+ * the interval has elapsed stops new transactions from starting in
+ * transaction_new, waits for those in flight to end, applies the new
+ * settings and lets everyone continue. Each decision is logged. Running
+ * transactions are found from the same per-thread slots reclamation uses, so
+ * the handshake writes no shared counter.
+ *
+ * A transaction ends when it commits successfully or is passed to
+ * transaction_abort or transaction_abandon. Every transaction_new must be
+ * matched by one of these, or the controller will wait forever.
+ */
+
+
+/*
+ * _stm_backoff_us: Base delay in microseconds before an aborted transaction
+ * retries. Grows exponentially with consecutive aborts on a thread.
+ */
+extern int _stm_backoff_us;
+
+
+/*
+ * stm_stats_t: Commit and abort counts for a single thread.
+ */
+typedef struct {
+    unsigned long commits;
+    unsigned long aborts;
+} stm_stats_t;
+
+
+void stm_adaptive_enable(int interval_ms, FILE *log);
+void stm_adaptive_disable();
+stm_stats_t stm_get_stats();  // Summed over all threads.
+
+// Used by transactions to take part in the quiescent point handshake.
+void _stm_quiesce_enter(int *version);
+void _stm_stats_commit();
+void _stm_stats_abort();
+void _stm_backoff();
 
 
 /*
@@ -120,16 +174,21 @@ void *read_op_read(read_op_t read_op);  // Not responsible for validation.
 
 /*
  * write_op_t: Single write transaction.
+ *
+ * A write may cover only a range of the atom, in which case only that
+ * range is copied back at commit.
  */
 typedef struct {
     atom_t *atom;
     void *src;    // Pointer to value to write to atom.
     int version_number;
     size_t src_size;  // Size of value at src.
+    size_t offset;    // Start of the written range within the atom.
 } write_op_t;
 
 
 write_op_t write_op_new(atom_t *atom, void *src, int version_number, size_t src_size);
+write_op_t write_op_new_range(atom_t *atom, size_t offset, void *src, int version_number, size_t src_size);
 bool write_op_validate(write_op_t *write_op);
 void write_op_write(write_op_t write_op);  // Not responsible for validation.
 
@@ -147,39 +206,107 @@ typedef struct {
 } readset_t;
 
 
-readset_t new_readset();
-void readset_append(readset_t readset, read_op_t *read_op);
-bool readset_validate_last_read(readset_t readset);
-bool readset_validate_all(readset_t readset);
-void readset_free_ops(readset_t readset);
+readset_t *new_readset();
+void readset_append(readset_t *readset, read_op_t *read_op);
+bool readset_validate_last_read(readset_t *readset);
+void readset_free_ops(readset_t *readset);
 
 
 /*
- * readset_t: Set of write operations for an atomic code block.
+ * writeset_t: Set of write operations for an atomic code block.
+ *
+ * Operations are kept per atom, so finding an atom's writes and locking each
+ * written atom once stay linear in the size of the set.
  */
 typedef struct {
-    GSList *write_ops;  // See readset_t for reason to use llist.
+    GHashTable *atoms;  // Each written atom_t * to a llist of its operations, most recent first.
+    GSList *atom_list;  // Each written atom once; see readset_t for reason to use llist.
+    write_op_t *last_write;
     int num_write_ops;
 } writeset_t;
 
 
-writeset_t new_writeset();
-void writeset_append(writeset_t writeset, write_op_t *write_op);
-int writeset_lock(writeset_t writeset);           // To be used just before commit.
-void writeset_unlock(writeset_t writeset);         // ^
-bool writeset_validate_all(writeset_t writeset);    // ^^
-bool writeset_validate_last_write(writeset_t writeset);
-void writeset_commit(writeset_t writeset);
-void writeset_free_ops(writeset_t writeset);
+writeset_t *new_writeset();
+void writeset_append(writeset_t *writeset, write_op_t *write_op);
+bool writeset_contains(writeset_t *writeset, atom_t *atom);
+GSList *writeset_atom_ops(writeset_t *writeset, atom_t *atom);  // Operations that reach the atom at commit.
+int writeset_lock(writeset_t *writeset);           // To be used just before commit.
+void writeset_unlock(writeset_t *writeset);         // ^
+bool writeset_validate_all(writeset_t *writeset);    // ^^
+bool writeset_validate_last_write(writeset_t *writeset);
+void writeset_commit(writeset_t *writeset, int version_number);
+void writeset_free_ops(writeset_t *writeset);
+bool readset_validate_all(readset_t *readset, writeset_t *locked);  // Atoms in locked are held by the caller.
+
+
+/*
+ * Durable atoms: atoms whose address lies in the heap file mapped by
+ * stm_durable_open survive restarts.
+ *
+ * At commit, the durable part of the write set is appended to a memory-mapped
+ * redo log and applied to the heap, which is mapped privately so its writes
+ * only reach the file at checkpoints. The log is flushed once the written
+ * atoms are unlocked; concurrent commits share a single msync (group commit),
+ * and a commit only returns and runs its hooks once its writes are durable.
+ * When the log fills, it is flushed, the heap pages written since the last
+ * checkpoint are written back to the file and synced, and the log is emptied.
+ * Opening the heap again replays complete transactions from the log.
+ */
+int stm_durable_open(const char *heap_path, size_t heap_size, const char *log_path, size_t log_size);
+void stm_durable_close();
+void *stm_durable_alloc(size_t size);
+void *stm_durable_root(size_t size);
+bool stm_durable_contains(void *address);
+
+// Used by transaction_commit. An LSN of 0 means nothing was logged.
+uint64_t _stm_durable_log(writeset_t *writeset);
+void _stm_durable_applied(uint64_t lsn);
+void _stm_durable_wait(uint64_t lsn);
+
+
+/*
+ * stm_hook_t: A deferred action registered by a transaction, to be
+ * run once the transaction has committed or aborted.
+ */
+typedef void (*stm_hook_fn)(void *arg);
+
+typedef struct {
+    stm_hook_fn fn;
+    void *arg;
+} stm_hook_t;
+
+
+/*
+ * Flush hooks: each thread may set one hook that runs once per batch of its
+ * commits rather than once per commit. Commit hooks still run straight after
+ * their own commit, so they can gather work cheaply, e.g. append to a buffer,
+ * and the flush hook write it all out with one call.
+ */
+void stm_on_flush(stm_hook_fn fn, void *arg, int num_commits);
+void stm_flush_hooks();  // Runs this thread's flush hook now if commits are pending.
+
+
+/*
+ * stm_log_t: Memory owned by a transaction for the operations it records and
+ * copies of the values it writes. Blocks never move, so pointers into the log
+ * stay valid until the transaction commits or aborts.
+ */
+typedef struct {
+    GSList *blocks;  // Most recent block first.
+    size_t used;     // Bytes used in the most recent block.
+    size_t capacity; // Size of the most recent block.
+} stm_log_t;
 
 
 /*
  * transaction_t: State of a currently operating transaction.
  */
 typedef struct {
-    readset_t readset;
-    writeset_t writeset;
-    void **malloc_pnts;  // Pointers to malloc'd memory locations during transaction
+    readset_t *readset;    // Sets, log and hook queues are held by pointer
+    writeset_t *writeset;  // so copies of the transaction share them.
+    stm_log_t *log;
+    GQueue *commit_hooks;  // Queues of stm_hook_t, in registration order.
+    GQueue *abort_hooks;
     char *buf_name;     // Name of transaction and setjmp buffer at transaction's start.
     int version_number;
 } transaction_t;
@@ -188,11 +315,19 @@ typedef struct {
 transaction_t transaction_new(char *name);
 void transaction_add_read(transaction_t transaction, read_op_t *read_op);
 void *transaction_get_read(transaction_t transaction, atom_t *atom);
+void *transaction_log_alloc(transaction_t transaction, size_t size);
+bool transaction_read(transaction_t transaction, atom_t *atom, void *dest);          // Returns false if invalid
+bool transaction_write(transaction_t transaction, atom_t *atom, const void *src);   // Returns false if invalid
+bool transaction_read_range(transaction_t transaction, atom_t *atom, size_t offset, void *dest, size_t size);
+bool transaction_write_range(transaction_t transaction, atom_t *atom, size_t offset, const void *src, size_t size);
 bool transaction_validate_last_read(transaction_t transaction);  // Returns nonzero if invalid
 void transaction_add_write(transaction_t transaction, write_op_t *write_op);
 bool transaction_validate_last_write(transaction_t transaction);  // Returns nonzero if invalid
 void *transaction_add_malloc(transaction_t transaction, size_t size);
 void transaction_add_free(transaction_t transaction, void *pnt);
+void transaction_add_commit_hook(transaction_t transaction, stm_hook_fn fn, void *arg);
+void transaction_add_abort_hook(transaction_t transaction, stm_hook_fn fn, void *arg);
+void transaction_abandon(transaction_t transaction);  // Ends without retrying; see adaptive tuning above.
 void transaction_abort(transaction_t transaction);
 int transaction_commit(transaction_t transaction);     // Returns nonzero if commit failed
 
@@ -203,13 +338,21 @@ int transaction_commit(transaction_t transaction);     // Returns nonzero if com
 // Utility macro for buffer name.
 #define _Buf(TRANS_NAME) __buf_ ## TRANS_NAME  ## __
 
-// Called by other macros to return to start of transaction.
-#define _Abort(TRANS_NAME) longjmp(_Buf(TRANS_NAME))
+// Called by other macros to roll back and return to start of transaction,
+// where a new transaction is begun.
+#define _Abort(TRANS_NAME) do { \
+    transaction_abort(_Trans(TRANS_NAME)); \
+    longjmp(_Buf(TRANS_NAME), 1); \
+    } while(0)
 
 
 /*
  * StartTransaction: Begin a transaction with name TRANS_NAME (not a string).
  *
+ * Declares the transaction and its setjmp buffer in the enclosing block, which
+ * must also contain the matching EndTransaction. An abort jumps back here and
+ * begins a new transaction.
+ *
  * Two transactions can have the same name without conflict, as long as they are
  * never in the same scope.
  *
@@ -217,12 +360,11 @@ int transaction_commit(transaction_t transaction);     // Returns nonzero if com
  *
  * This macro must be called on a separate line.
  */
-#define StartTransaction(TRANS_NAME) do { \
-    transaction_t _Trans(TRANS_NAME) = transaction_new(#TRANS_NAME); \
+#define StartTransaction(TRANS_NAME) \
+    transaction_t _Trans(TRANS_NAME); \
     jmp_buf _Buf(TRANS_NAME); \
-    if(!setjmp(_Buf(TRANS_NAME))) \
-        transaction_abort(_Trans(TRANS_NAME)); \
-    } while(0)
+    setjmp(_Buf(TRANS_NAME)); \
+    _Trans(TRANS_NAME) = transaction_new(#TRANS_NAME)
 
 
 /*
@@ -239,37 +381,225 @@ int transaction_commit(transaction_t transaction);     // Returns nonzero if com
 
 
 /*
- * ReadAtom: Read the value of an atom into an address.
+ * ReadAtom: Read the value of an atom into an address. dest_type must be
+ * the size of the whole atom; use ReadAtomField to read part of it.
  *
  * Must be called on a separate line. Should be used with caution if called in a separate function,
  * as it uses a longjmp() to abort if need be.
  */
 #define ReadAtom(atom, dest, dest_type, TRANS_NAME) do { \
-    transaction_add_read(_Trans(TRANS_NAME), read_op_new(atom, (void *) dest, stm_get_clock())); \
-    if(!transaction_validate_last_read(_Trans(TRANS_NAME))) \
+    atom_check_size(&(atom), sizeof(dest_type)); \
+    if(!transaction_read(_Trans(TRANS_NAME), &(atom), dest)) \
         _Abort(TRANS_NAME); \
-    *(dest) = * (dest_type *) transaction_get_read(_Trans(TRANS_NAME), &(atom));\
     } while(0)
 
 
 /*
- * WriteAtom: Write a value to an atom from an address.
+ * WriteAtom: Write a value to an atom from an address. The value is copied,
+ * so src need not outlive the call. src_type must be the size of the whole
+ * atom; use WriteAtomField to write part of it.
  *
  * Must be called on a separate line. Should be used with caution if called in a separate function,
  * as it uses a longjmp() to abort if need be.
  */
 #define WriteAtom(atom, src, src_type, TRANS_NAME) do { \
-    transaction_add_write(_Trans(TRANS_NAME), write_op_new(atom, src, stm_get_clock(), sizeof(src_type))); \
-    if(!transaction_validate_last_write(_Trans(TRANS_NAME))) \
+    atom_check_size(&(atom), sizeof(src_type)); \
+    if(!transaction_write(_Trans(TRANS_NAME), &(atom), src)) \
         _Abort(TRANS_NAME); \
     } while(0)
 
 
-// These will simply log the memory allocations performed for cleanup at abort.
+/*
+ * ReadAtomField: Read one field of a struct atom into an address.
+ *
+ * Only the field is copied, merged with any earlier writes to the atom
+ * within the transaction. Must be called on a separate line.
+ */
+#define ReadAtomField(atom, atom_type, field, dest, TRANS_NAME) do { \
+    if(!transaction_read_range(_Trans(TRANS_NAME), &(atom), offsetof(atom_type, field), dest, \
+                               sizeof(((atom_type *) 0)->field))) \
+        _Abort(TRANS_NAME); \
+    } while(0)
+
+
+/*
+ * WriteAtomField: Write one field of a struct atom from an address.
+ *
+ * Only the field is logged, as (offset, size, bytes) in the transaction's
+ * own log, and only it is written back at commit. The value at src is
+ * copied, so it need not outlive the call. Must be called on a separate line.
+ */
+#define WriteAtomField(atom, atom_type, field, src, TRANS_NAME) do { \
+    if(!transaction_write_range(_Trans(TRANS_NAME), &(atom), offsetof(atom_type, field), src, \
+                                sizeof(((atom_type *) 0)->field))) \
+        _Abort(TRANS_NAME); \
+    } while(0)
+
+
+// Memory from stm_malloc is freed if the transaction aborts; stm_free only
+// frees once the transaction has committed.
 
 #define stm_malloc(size, TRANS_NAME) transaction_add_malloc(_Trans(TRANS_NAME), size)
 #define stm_free(pnt, TRANS_NAME) transaction_add_free(_Trans(TRANS_NAME), pnt)
 
 
+/*
+ * Transactional containers, built from atoms and laid out so that unrelated
+ * operations touch disjoint atoms.
+ *
+ * Operations take the transaction as their first argument and return false
+ * if it must abort. Several can be composed in one transaction with StmOp,
+ * e.g. StmOp(stm_queue_pop, trans, &queue, &value, &found).
+ *
+ * Nodes unlinked by a committed transaction may still be read by others,
+ * so they are retired, and only freed once every transaction running at the
+ * time has ended.
+ */
+
+
+/*
+ * stm_retired_t: Memory unlinked from a container, each piece stamped with
+ * the clock when it was retired. Freed in batches by later retirements once
+ * stm_oldest_active_version passes the stamp, or with the container.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    GQueue *pnts;  // Oldest first.
+} stm_retired_t;
+
+
+/*
+ * stm_counter_t: Counter split over stripes on separate cache lines. Each
+ * thread adds to its own stripe; only reading the total touches every stripe.
+ */
+typedef struct {
+    long value;
+    atom_t atom;
+} __attribute__((aligned(64))) stm_counter_stripe_t;
+
+typedef struct {
+    int num_stripes;
+    stm_counter_stripe_t *stripes;
+} stm_counter_t;
+
+
+stm_counter_t *stm_counter_new(int num_stripes);
+void stm_counter_free(stm_counter_t *counter);
+bool stm_counter_add(transaction_t transaction, stm_counter_t *counter, long delta);
+bool stm_counter_get(transaction_t transaction, stm_counter_t *counter, long *total);
+
+
+/*
+ * stm_queue_t: FIFO queue with a dummy head node and separate head and tail
+ * atoms, so pushes and pops only conflict when the queue is nearly empty.
+ */
+typedef struct stm_queue_node {
+    void *value;
+    struct stm_queue_node *next;
+    atom_t next_atom;
+} stm_queue_node_t;
+
+typedef struct {
+    stm_queue_node_t *node;
+    atom_t atom;
+} __attribute__((aligned(64))) stm_queue_end_t;
+
+typedef struct {
+    stm_queue_end_t head;  // Dummy node; its successor is the front of the queue.
+    stm_queue_end_t tail;
+    stm_retired_t retired;
+} stm_queue_t;
+
+
+stm_queue_t *stm_queue_new();
+void stm_queue_free(stm_queue_t *queue);
+bool stm_queue_push(transaction_t transaction, stm_queue_t *queue, void *value);
+bool stm_queue_pop(transaction_t transaction, stm_queue_t *queue, void **value, bool *found);
+
+
+/*
+ * stm_map_t: Hash map with an atom per bucket and per node field, so
+ * operations on different keys rarely conflict. Updating an existing key
+ * only writes that node's value atom. A bucket chain growing past a limit
+ * makes the inserting transaction double the table.
+ */
+typedef struct stm_map_node {
+    uint64_t key;
+    void *value;
+    struct stm_map_node *next;
+    atom_t value_atom;
+    atom_t next_atom;
+} stm_map_node_t;
+
+typedef struct {
+    size_t num_buckets;  // Always a power of two.
+    stm_map_node_t **heads;
+    atom_t *bucket_atoms;
+} stm_map_table_t;
+
+typedef struct {
+    stm_map_table_t *table;
+    atom_t table_atom;
+    stm_counter_t *size;
+    stm_retired_t retired;
+} stm_map_t;
+
+
+stm_map_t *stm_map_new(size_t num_buckets);
+void stm_map_free(stm_map_t *map);
+bool stm_map_get(transaction_t transaction, stm_map_t *map, uint64_t key, void **value, bool *found);
+bool stm_map_put(transaction_t transaction, stm_map_t *map, uint64_t key, void *value);
+bool stm_map_remove(transaction_t transaction, stm_map_t *map, uint64_t key, bool *removed);
+bool stm_map_size(transaction_t transaction, stm_map_t *map, long *size);
+
+
+/*
+ * stm_skiplist_t: Ordered map as a skip list. Every link is its own atom,
+ * so inserts and removes only conflict with neighbouring keys.
+ */
+#define STM_SKIPLIST_MAX_LEVEL 16
+
+typedef struct stm_skiplist_node {
+    uint64_t key;
+    void *value;
+    atom_t value_atom;
+    int height;
+    struct stm_skiplist_node **next;  // One link and atom per level.
+    atom_t *next_atoms;
+} stm_skiplist_node_t;
+
+typedef struct {
+    stm_skiplist_node_t *head;  // Sentinel of full height.
+    stm_retired_t retired;
+} stm_skiplist_t;
+
+
+stm_skiplist_t *stm_skiplist_new();
+void stm_skiplist_free(stm_skiplist_t *list);
+bool stm_skiplist_get(transaction_t transaction, stm_skiplist_t *list, uint64_t key, void **value, bool *found);
+bool stm_skiplist_put(transaction_t transaction, stm_skiplist_t *list, uint64_t key, void *value);
+bool stm_skiplist_remove(transaction_t transaction, stm_skiplist_t *list, uint64_t key, bool *removed);
+
+
+/*
+ * StmOp: Call a function taking the transaction as its first argument,
+ * aborting the transaction if it returns false.
+ *
+ * Must be called on a separate line.
+ */
+#define StmOp(fn, TRANS_NAME, ...) do { \
+    if(!fn(_Trans(TRANS_NAME), __VA_ARGS__)) \
+        _Abort(TRANS_NAME); \
+    } while(0)
+
+
+// These defer side effects until the transaction's outcome is known.
+// Commit hooks run after the write set is unlocked, abort hooks on rollback,
+// both in registration order.
+
+#define stm_on_commit(fn, arg, TRANS_NAME) transaction_add_commit_hook(_Trans(TRANS_NAME), fn, arg)
+#define stm_on_abort(fn, arg, TRANS_NAME) transaction_add_abort_hook(_Trans(TRANS_NAME), fn, arg)
+
+
 #endif // STM_H
 
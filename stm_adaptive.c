@@ -0,0 +1,240 @@
+/*
+ * File: stm_adaptive.c
+ *
+ * Per-thread transaction statistics, retry backoff and the optional
+ * adaptive controller that retunes them at a global quiescent point.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <glib.h>
+#include "stm.h"
+
+
+// Abort rates above HIGH back off harder, rates below LOW relax again.
+#define STM_ADAPTIVE_HIGH_ABORT_RATE 0.3
+#define STM_ADAPTIVE_LOW_ABORT_RATE 0.05
+#define STM_BACKOFF_MAX_US 1024
+#define STM_BACKOFF_MAX_SHIFT 6
+
+
+int _stm_backoff_us = 0;
+
+// Per-thread counters, also registered globally so they can be summed.
+static __thread stm_stats_t *_stm_thread_stats = NULL;
+static __thread int _stm_consecutive_aborts = 0;
+static __thread unsigned int _stm_backoff_seed = 0;
+static GSList *_stm_all_stats = NULL;
+static pthread_mutex_t _stm_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Controller state, guarded by _stm_controller_lock. The interval and the time
+// of the last sample are also checked without it, so they are written atomically.
+static bool _stm_adaptive_on = false;
+static int _stm_adaptive_interval_ms;
+static FILE *_stm_adaptive_log;
+static long _stm_last_sample_ms;
+static stm_stats_t _stm_last_totals;
+static pthread_mutex_t _stm_controller_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Quiescent point handshake between the controller and transaction_new.
+static int _stm_switch_pending = 0;
+
+
+// Statistics functions
+
+
+/*
+ * thread_stats: Get this thread's counters, registering them on first use.
+ *
+ * Counters are never freed, so totals stay correct after a thread exits.
+ */
+static stm_stats_t *thread_stats() {
+    if(_stm_thread_stats == NULL) {
+        _stm_thread_stats = g_new0(stm_stats_t, 1);
+        pthread_mutex_lock(&_stm_stats_lock);
+        _stm_all_stats = g_slist_prepend(_stm_all_stats, _stm_thread_stats);
+        pthread_mutex_unlock(&_stm_stats_lock);
+    }
+    return _stm_thread_stats;
+}
+
+
+/*
+ * _stm_stats_commit: Record a successful commit on this thread.
+ */
+void _stm_stats_commit() {
+    stm_stats_t *stats = thread_stats();
+    __atomic_store_n(&stats->commits, stats->commits + 1, __ATOMIC_RELAXED);
+    _stm_consecutive_aborts = 0;
+}
+
+
+/*
+ * _stm_stats_abort: Record an abort on this thread.
+ */
+void _stm_stats_abort() {
+    stm_stats_t *stats = thread_stats();
+    __atomic_store_n(&stats->aborts, stats->aborts + 1, __ATOMIC_RELAXED);
+    _stm_consecutive_aborts++;
+}
+
+
+/*
+ * stm_get_stats: Sum the commit and abort counts of every thread.
+ */
+stm_stats_t stm_get_stats() {
+    stm_stats_t totals = {0, 0};
+    pthread_mutex_lock(&_stm_stats_lock);
+    for(GSList *current = _stm_all_stats; current != NULL; current = current->next) {
+        stm_stats_t *stats = (stm_stats_t *) current->data;
+        totals.commits += __atomic_load_n(&stats->commits, __ATOMIC_RELAXED);
+        totals.aborts += __atomic_load_n(&stats->aborts, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&_stm_stats_lock);
+    return totals;
+}
+
+
+/*
+ * _stm_backoff: Sleep before an aborted transaction retries.
+ *
+ * The delay is randomised up to _stm_backoff_us doubled for each consecutive
+ * abort on this thread, so colliding transactions spread out.
+ */
+void _stm_backoff() {
+    int backoff_us = __atomic_load_n(&_stm_backoff_us, __ATOMIC_RELAXED);
+    if(backoff_us <= 0)
+        return;
+    if(_stm_backoff_seed == 0)
+        _stm_backoff_seed = (unsigned int) (size_t) pthread_self() | 1;
+    int shift = MIN(_stm_consecutive_aborts, STM_BACKOFF_MAX_SHIFT);
+    usleep(rand_r(&_stm_backoff_seed) % (backoff_us << shift) + 1);
+}
+
+
+// Adaptive controller functions
+
+
+static long now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/*
+ * adaptive_decide: Choose a new retry backoff from the commits and aborts seen
+ * over the last interval, apply it and log the decision.
+ *
+ * High abort rates back off retries harder; low rates relax backoff again.
+ * Hook batching changes when user side effects run, so it is left to users.
+ * Must only be called at a quiescent point.
+ */
+static void adaptive_decide(stm_stats_t delta, long elapsed_ms) {
+    unsigned long total = delta.commits + delta.aborts;
+    int backoff_us = _stm_backoff_us;
+    double abort_rate;
+    if(total == 0)
+        return;
+    abort_rate = (double) delta.aborts / total;
+    if(abort_rate > STM_ADAPTIVE_HIGH_ABORT_RATE)
+        backoff_us = backoff_us ? MIN(backoff_us * 2, STM_BACKOFF_MAX_US) : 1;
+    else if(abort_rate < STM_ADAPTIVE_LOW_ABORT_RATE)
+        backoff_us /= 2;
+    if(_stm_adaptive_log != NULL)
+        fprintf(_stm_adaptive_log,
+                "stm adaptive: %ldms commits=%lu aborts=%lu abort_rate=%.3f "
+                "backoff_us %d -> %d\n",
+                elapsed_ms, delta.commits, delta.aborts, abort_rate,
+                _stm_backoff_us, backoff_us);
+    __atomic_store_n(&_stm_backoff_us, backoff_us, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * adaptive_sample: If the interval has elapsed, stop new transactions,
+ * wait for those in flight to finish and retune the engine.
+ *
+ * Only one thread samples at a time; others carry on without waiting here.
+ */
+static void adaptive_sample() {
+    long now;
+    stm_stats_t totals, delta;
+    if(pthread_mutex_trylock(&_stm_controller_lock))
+        return;
+    now = now_ms();
+    if(!_stm_adaptive_on || now - _stm_last_sample_ms < _stm_adaptive_interval_ms) {
+        pthread_mutex_unlock(&_stm_controller_lock);
+        return;
+    }
+
+    __atomic_store_n(&_stm_switch_pending, 1, __ATOMIC_SEQ_CST);
+    while(!_stm_transactions_idle())
+        sched_yield();
+
+    totals = stm_get_stats();
+    delta.commits = totals.commits - _stm_last_totals.commits;
+    delta.aborts = totals.aborts - _stm_last_totals.aborts;
+    adaptive_decide(delta, now - _stm_last_sample_ms);
+    _stm_last_totals = totals;
+    __atomic_store_n(&_stm_last_sample_ms, now, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&_stm_switch_pending, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&_stm_controller_lock);
+}
+
+
+/*
+ * _stm_quiesce_enter: Mark the start of a transaction by publishing the clock
+ * in this thread's version slot, first sampling if the interval is up and
+ * waiting out any switch in progress.
+ *
+ * The slot is reset to INT_MAX when the transaction ends.
+ */
+void _stm_quiesce_enter(int *version) {
+    if(__atomic_load_n(&_stm_adaptive_on, __ATOMIC_ACQUIRE)
+            && now_ms() - __atomic_load_n(&_stm_last_sample_ms, __ATOMIC_RELAXED)
+               >= __atomic_load_n(&_stm_adaptive_interval_ms, __ATOMIC_RELAXED))
+        adaptive_sample();
+    for(;;) {
+        while(__atomic_load_n(&_stm_switch_pending, __ATOMIC_SEQ_CST))
+            sched_yield();
+        __atomic_store_n(version, __atomic_load_n(&_stm_global_clock, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+        if(!__atomic_load_n(&_stm_switch_pending, __ATOMIC_SEQ_CST))
+            return;
+        // Raced with a switch starting; step back out and wait for it.
+        __atomic_store_n(version, INT_MAX, __ATOMIC_SEQ_CST);
+    }
+}
+
+
+/*
+ * stm_adaptive_enable: Start retuning the engine every interval_ms
+ * milliseconds. Decisions are written to log if it is not NULL.
+ */
+void stm_adaptive_enable(int interval_ms, FILE *log) {
+    pthread_mutex_lock(&_stm_controller_lock);
+    __atomic_store_n(&_stm_adaptive_interval_ms, interval_ms, __ATOMIC_RELAXED);
+    _stm_adaptive_log = log;
+    __atomic_store_n(&_stm_last_sample_ms, now_ms(), __ATOMIC_RELAXED);
+    _stm_last_totals = stm_get_stats();
+    __atomic_store_n(&_stm_adaptive_on, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&_stm_controller_lock);
+}
+
+
+/*
+ * stm_adaptive_disable: Stop retuning. Current settings are kept.
+ */
+void stm_adaptive_disable() {
+    pthread_mutex_lock(&_stm_controller_lock);
+    __atomic_store_n(&_stm_adaptive_on, false, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&_stm_controller_lock);
+}
@@ -0,0 +1,585 @@
+/*
+ * File: stm_containers.c
+ *
+ * Transactional containers built on atoms: a striped counter, a FIFO
+ * queue, a hash map and a skip list.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <glib.h>
+#include "stm.h"
+
+
+// Bucket chain length at which an insert doubles the map's table.
+#define STM_MAP_MAX_CHAIN 8
+#define STM_MAP_MAX_BUCKETS ((size_t) 1 << 24)
+
+// Retired memory waiting before a retirement tries to free some of it.
+#define STM_RECLAIM_BATCH 32
+
+// Next stripe to hand out, and this thread's stripe and skip list seed.
+static int _stm_next_stripe = 0;
+static __thread int _stm_thread_stripe = -1;
+static __thread unsigned int _stm_level_seed = 0;
+
+
+// Retirement functions
+
+
+typedef struct {
+    stm_retired_t *retired;
+    void *pnt;
+    int version;  // Clock when retired.
+} retire_record_t;
+
+
+static void retired_init(stm_retired_t *retired) {
+    pthread_mutex_init(&retired->lock, NULL);
+    retired->pnts = g_queue_new();
+}
+
+
+static void retired_free(stm_retired_t *retired) {
+    retire_record_t *record;
+    while((record = g_queue_pop_head(retired->pnts)) != NULL) {
+        g_free(record->pnt);
+        g_free(record);
+    }
+    g_queue_free(retired->pnts);
+    pthread_mutex_destroy(&retired->lock);
+}
+
+
+/*
+ * retire_on_commit: Stamp memory unlinked by a committed transaction and add
+ * it to the retired list, then free whatever no running transaction can reach.
+ *
+ * Stamps are taken under the list's lock, so the list stays in stamp order.
+ */
+static void retire_on_commit(void *arg) {
+    retire_record_t *record = (retire_record_t *) arg;
+    stm_retired_t *retired = record->retired;
+    pthread_mutex_lock(&retired->lock);
+    record->version = __atomic_load_n(&_stm_global_clock, __ATOMIC_SEQ_CST);
+    g_queue_push_tail(retired->pnts, record);
+    if(g_queue_get_length(retired->pnts) >= STM_RECLAIM_BATCH) {
+        int oldest = stm_oldest_active_version();
+        while((record = g_queue_peek_head(retired->pnts)) != NULL && record->version < oldest) {
+            g_queue_pop_head(retired->pnts);
+            g_free(record->pnt);
+            g_free(record);
+        }
+    }
+    pthread_mutex_unlock(&retired->lock);
+}
+
+
+/*
+ * retire: Hand memory unlinked by the transaction to a container's retired
+ * list once the transaction commits.
+ */
+static void retire(transaction_t transaction, stm_retired_t *retired, void *pnt) {
+    retire_record_t *record = g_new(retire_record_t, 1);
+    record->retired = retired;
+    record->pnt = pnt;
+    transaction_add_commit_hook(transaction, retire_on_commit, record);
+    transaction_add_abort_hook(transaction, g_free, record);
+}
+
+
+/*
+ * fresh: Allocate zeroed memory private to the transaction, freed if it aborts.
+ */
+static void *fresh(transaction_t transaction, size_t size) {
+    void *pnt = g_malloc0(size);
+    transaction_add_abort_hook(transaction, g_free, pnt);
+    return pnt;
+}
+
+
+// Striped counter functions
+
+
+/*
+ * stm_counter_new: Create a counter of value 0 split over num_stripes stripes.
+ */
+stm_counter_t *stm_counter_new(int num_stripes) {
+    stm_counter_t *counter = g_new(stm_counter_t, 1);
+    counter->num_stripes = num_stripes < 1 ? 1 : num_stripes;
+    if(posix_memalign((void **) &counter->stripes, 64,
+                      counter->num_stripes * sizeof(stm_counter_stripe_t))) {
+        printf("Error: Could not allocate counter stripes");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < counter->num_stripes; i++) {
+        counter->stripes[i].value = 0;
+        counter->stripes[i].atom = atomize(&counter->stripes[i].value, sizeof(long));
+    }
+    return counter;
+}
+
+
+void stm_counter_free(stm_counter_t *counter) {
+    free(counter->stripes);
+    g_free(counter);
+}
+
+
+/*
+ * stm_counter_add: Add delta to this thread's stripe of the counter.
+ */
+bool stm_counter_add(transaction_t transaction, stm_counter_t *counter, long delta) {
+    long value;
+    if(_stm_thread_stripe < 0)
+        _stm_thread_stripe = __atomic_fetch_add(&_stm_next_stripe, 1, __ATOMIC_RELAXED);
+    atom_t *atom = &counter->stripes[_stm_thread_stripe % counter->num_stripes].atom;
+    if(!transaction_read(transaction, atom, &value))
+        return false;
+    value += delta;
+    return transaction_write(transaction, atom, &value);
+}
+
+
+/*
+ * stm_counter_get: Read the counter's total. This reads every stripe, so it
+ * conflicts with all concurrent adds.
+ */
+bool stm_counter_get(transaction_t transaction, stm_counter_t *counter, long *total) {
+    long value;
+    *total = 0;
+    for(int i = 0; i < counter->num_stripes; i++) {
+        if(!transaction_read(transaction, &counter->stripes[i].atom, &value))
+            return false;
+        *total += value;
+    }
+    return true;
+}
+
+
+// Queue functions
+
+
+static stm_queue_node_t *queue_node_init(stm_queue_node_t *node, void *value) {
+    node->value = value;
+    node->next = NULL;
+    node->next_atom = atomize(&node->next, sizeof(stm_queue_node_t *));
+    return node;
+}
+
+
+/*
+ * stm_queue_new: Create an empty queue.
+ */
+stm_queue_t *stm_queue_new() {
+    stm_queue_t *queue;
+    if(posix_memalign((void **) &queue, 64, sizeof(stm_queue_t))) {
+        printf("Error: Could not allocate queue");
+        exit(EXIT_FAILURE);
+    }
+    stm_queue_node_t *dummy = queue_node_init(g_new(stm_queue_node_t, 1), NULL);
+    queue->head.node = queue->tail.node = dummy;
+    queue->head.atom = atomize(&queue->head.node, sizeof(stm_queue_node_t *));
+    queue->tail.atom = atomize(&queue->tail.node, sizeof(stm_queue_node_t *));
+    retired_init(&queue->retired);
+    return queue;
+}
+
+
+/*
+ * stm_queue_free: Free a queue and every node in it. Values are not freed.
+ */
+void stm_queue_free(stm_queue_t *queue) {
+    stm_queue_node_t *node = queue->head.node;
+    while(node != NULL) {
+        stm_queue_node_t *next = node->next;
+        g_free(node);
+        node = next;
+    }
+    retired_free(&queue->retired);
+    free(queue);
+}
+
+
+/*
+ * stm_queue_push: Add a value to the back of the queue.
+ */
+bool stm_queue_push(transaction_t transaction, stm_queue_t *queue, void *value) {
+    stm_queue_node_t *tail;
+    stm_queue_node_t *node = queue_node_init(fresh(transaction, sizeof(stm_queue_node_t)), value);
+    return transaction_read(transaction, &queue->tail.atom, &tail)
+        && transaction_write(transaction, &tail->next_atom, &node)
+        && transaction_write(transaction, &queue->tail.atom, &node);
+}
+
+
+/*
+ * stm_queue_pop: Take the value at the front of the queue. found is set to
+ * false if the queue is empty.
+ *
+ * The popped node becomes the new dummy and the old dummy is retired.
+ */
+bool stm_queue_pop(transaction_t transaction, stm_queue_t *queue, void **value, bool *found) {
+    stm_queue_node_t *head, *next;
+    if(!transaction_read(transaction, &queue->head.atom, &head)
+            || !transaction_read(transaction, &head->next_atom, &next))
+        return false;
+    *found = next != NULL;
+    if(!*found)
+        return true;
+    *value = next->value;  // Never changes once the node is pushed.
+    if(!transaction_write(transaction, &queue->head.atom, &next))
+        return false;
+    retire(transaction, &queue->retired, head);
+    return true;
+}
+
+
+// Hash map functions
+
+
+static size_t map_hash(uint64_t key) {
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return (size_t) key;
+}
+
+
+static stm_map_node_t *map_node_init(stm_map_node_t *node, uint64_t key, void *value, stm_map_node_t *next) {
+    node->key = key;
+    node->value = value;
+    node->next = next;
+    node->value_atom = atomize(&node->value, sizeof(void *));
+    node->next_atom = atomize(&node->next, sizeof(stm_map_node_t *));
+    return node;
+}
+
+
+/*
+ * map_table_new: Lay out an empty table in a block of map_table_bytes, so it
+ * can be freed with one g_free. num_buckets must be a power of two.
+ */
+static stm_map_table_t *map_table_new(stm_map_table_t *table, size_t num_buckets) {
+    table->num_buckets = num_buckets;
+    table->heads = (stm_map_node_t **) (table + 1);
+    table->bucket_atoms = (atom_t *) (table->heads + num_buckets);
+    for(size_t i = 0; i < num_buckets; i++) {
+        table->heads[i] = NULL;
+        table->bucket_atoms[i] = atomize(&table->heads[i], sizeof(stm_map_node_t *));
+    }
+    return table;
+}
+
+
+static size_t map_table_bytes(size_t num_buckets) {
+    return sizeof(stm_map_table_t) + num_buckets * (sizeof(stm_map_node_t *) + sizeof(atom_t));
+}
+
+
+/*
+ * map_find: Look up a key, reading the table, the key's bucket and the chain
+ * up to the key. node is NULL if the key is absent; prev is the node before
+ * it in the chain, or NULL if it is the bucket head.
+ */
+static bool map_find(transaction_t transaction, stm_map_t *map, uint64_t key, stm_map_table_t **table,
+                     atom_t **bucket, stm_map_node_t **prev, stm_map_node_t **node, int *chain_length) {
+    if(!transaction_read(transaction, &map->table_atom, table))
+        return false;
+    *bucket = &(*table)->bucket_atoms[map_hash(key) & ((*table)->num_buckets - 1)];
+    *prev = NULL;
+    *chain_length = 0;
+    if(!transaction_read(transaction, *bucket, node))
+        return false;
+    while(*node != NULL && (*node)->key != key) {
+        *prev = *node;
+        (*chain_length)++;
+        if(!transaction_read(transaction, &(*prev)->next_atom, node))
+            return false;
+    }
+    return true;
+}
+
+
+/*
+ * map_resize: Replace the table with one of twice as many buckets, holding
+ * copies of every node. The old table and nodes are retired.
+ */
+static bool map_resize(transaction_t transaction, stm_map_t *map, stm_map_table_t *old) {
+    size_t num_buckets = old->num_buckets * 2;
+    if(num_buckets > STM_MAP_MAX_BUCKETS)
+        return true;
+    stm_map_table_t *table = map_table_new(fresh(transaction, map_table_bytes(num_buckets)), num_buckets);
+
+    for(size_t i = 0; i < old->num_buckets; i++) {
+        stm_map_node_t *node;
+        if(!transaction_read(transaction, &old->bucket_atoms[i], &node))
+            return false;
+        while(node != NULL) {
+            void *value;
+            stm_map_node_t *next, **head = &table->heads[map_hash(node->key) & (num_buckets - 1)];
+            if(!transaction_read(transaction, &node->value_atom, &value)
+                    || !transaction_read(transaction, &node->next_atom, &next))
+                return false;
+            *head = map_node_init(fresh(transaction, sizeof(stm_map_node_t)), node->key, value, *head);
+            retire(transaction, &map->retired, node);
+            node = next;
+        }
+    }
+    if(!transaction_write(transaction, &map->table_atom, &table))
+        return false;
+    retire(transaction, &map->retired, old);
+    return true;
+}
+
+
+/*
+ * stm_map_new: Create an empty map. num_buckets is rounded up to a power of two.
+ */
+stm_map_t *stm_map_new(size_t num_buckets) {
+    stm_map_t *map = g_new(stm_map_t, 1);
+    size_t size = 1;
+    while(size < num_buckets)
+        size *= 2;
+    map->table = map_table_new(g_malloc(map_table_bytes(size)), size);
+    map->table_atom = atomize(&map->table, sizeof(stm_map_table_t *));
+    map->size = stm_counter_new(16);
+    retired_init(&map->retired);
+    return map;
+}
+
+
+/*
+ * stm_map_free: Free a map and all its nodes. Values are not freed.
+ */
+void stm_map_free(stm_map_t *map) {
+    for(size_t i = 0; i < map->table->num_buckets; i++) {
+        stm_map_node_t *node = map->table->heads[i];
+        while(node != NULL) {
+            stm_map_node_t *next = node->next;
+            g_free(node);
+            node = next;
+        }
+    }
+    g_free(map->table);
+    stm_counter_free(map->size);
+    retired_free(&map->retired);
+    g_free(map);
+}
+
+
+/*
+ * stm_map_get: Look up a key. found is set to false if it is absent.
+ */
+bool stm_map_get(transaction_t transaction, stm_map_t *map, uint64_t key, void **value, bool *found) {
+    stm_map_table_t *table;
+    stm_map_node_t *prev, *node;
+    atom_t *bucket;
+    int chain_length;
+    if(!map_find(transaction, map, key, &table, &bucket, &prev, &node, &chain_length))
+        return false;
+    *found = node != NULL;
+    return !*found || transaction_read(transaction, &node->value_atom, value);
+}
+
+
+/*
+ * stm_map_put: Set the value for a key, inserting it if absent.
+ */
+bool stm_map_put(transaction_t transaction, stm_map_t *map, uint64_t key, void *value) {
+    stm_map_table_t *table;
+    stm_map_node_t *prev, *node, *head;
+    atom_t *bucket;
+    int chain_length;
+    if(!map_find(transaction, map, key, &table, &bucket, &prev, &node, &chain_length))
+        return false;
+    if(node != NULL)
+        return transaction_write(transaction, &node->value_atom, &value);
+
+    // New keys go at the head of the bucket, which map_find has already read.
+    if(!transaction_read(transaction, bucket, &head))
+        return false;
+    node = map_node_init(fresh(transaction, sizeof(stm_map_node_t)), key, value, head);
+    if(!transaction_write(transaction, bucket, &node) || !stm_counter_add(transaction, map->size, 1))
+        return false;
+    if(chain_length + 1 >= STM_MAP_MAX_CHAIN)
+        return map_resize(transaction, map, table);
+    return true;
+}
+
+
+/*
+ * stm_map_remove: Remove a key. removed is set to false if it was absent.
+ */
+bool stm_map_remove(transaction_t transaction, stm_map_t *map, uint64_t key, bool *removed) {
+    stm_map_table_t *table;
+    stm_map_node_t *prev, *node, *next;
+    atom_t *bucket;
+    int chain_length;
+    if(!map_find(transaction, map, key, &table, &bucket, &prev, &node, &chain_length))
+        return false;
+    *removed = node != NULL;
+    if(!*removed)
+        return true;
+    if(!transaction_read(transaction, &node->next_atom, &next)
+            || !transaction_write(transaction, prev != NULL ? &prev->next_atom : bucket, &next)
+            || !stm_counter_add(transaction, map->size, -1))
+        return false;
+    retire(transaction, &map->retired, node);
+    return true;
+}
+
+
+/*
+ * stm_map_size: Read the number of keys in the map.
+ */
+bool stm_map_size(transaction_t transaction, stm_map_t *map, long *size) {
+    return stm_counter_get(transaction, map->size, size);
+}
+
+
+// Skip list functions
+
+
+/*
+ * skiplist_node_new: Lay out a node and its per-level links in a block of
+ * skiplist_node_bytes.
+ */
+static stm_skiplist_node_t *skiplist_node_new(stm_skiplist_node_t *node, int height, uint64_t key, void *value) {
+    node->key = key;
+    node->value = value;
+    node->value_atom = atomize(&node->value, sizeof(void *));
+    node->height = height;
+    node->next_atoms = (atom_t *) (node + 1);
+    node->next = (stm_skiplist_node_t **) (node->next_atoms + height);
+    for(int i = 0; i < height; i++) {
+        node->next[i] = NULL;
+        node->next_atoms[i] = atomize(&node->next[i], sizeof(stm_skiplist_node_t *));
+    }
+    return node;
+}
+
+
+static size_t skiplist_node_bytes(int height) {
+    return sizeof(stm_skiplist_node_t) + height * (sizeof(atom_t) + sizeof(stm_skiplist_node_t *));
+}
+
+
+static int skiplist_random_height() {
+    int height = 1;
+    if(_stm_level_seed == 0)
+        _stm_level_seed = (unsigned int) (size_t) pthread_self() | 1;
+    while(height < STM_SKIPLIST_MAX_LEVEL && (rand_r(&_stm_level_seed) & 1))
+        height++;
+    return height;
+}
+
+
+/*
+ * skiplist_find: Find, at every level, the last node with a key below key
+ * (preds) and the node after it (succs).
+ */
+static bool skiplist_find(transaction_t transaction, stm_skiplist_t *list, uint64_t key,
+                          stm_skiplist_node_t **preds, stm_skiplist_node_t **succs) {
+    stm_skiplist_node_t *pred = list->head, *succ;
+    for(int level = STM_SKIPLIST_MAX_LEVEL - 1; level >= 0; level--) {
+        for(;;) {
+            if(!transaction_read(transaction, &pred->next_atoms[level], &succ))
+                return false;
+            if(succ == NULL || succ->key >= key)
+                break;
+            pred = succ;
+        }
+        preds[level] = pred;
+        succs[level] = succ;
+    }
+    return true;
+}
+
+
+/*
+ * stm_skiplist_new: Create an empty skip list.
+ */
+stm_skiplist_t *stm_skiplist_new() {
+    stm_skiplist_t *list = g_new(stm_skiplist_t, 1);
+    list->head = skiplist_node_new(g_malloc(skiplist_node_bytes(STM_SKIPLIST_MAX_LEVEL)),
+                                   STM_SKIPLIST_MAX_LEVEL, 0, NULL);
+    retired_init(&list->retired);
+    return list;
+}
+
+
+/*
+ * stm_skiplist_free: Free a skip list and all its nodes. Values are not freed.
+ */
+void stm_skiplist_free(stm_skiplist_t *list) {
+    stm_skiplist_node_t *node = list->head;
+    while(node != NULL) {
+        stm_skiplist_node_t *next = node->next[0];
+        g_free(node);
+        node = next;
+    }
+    retired_free(&list->retired);
+    g_free(list);
+}
+
+
+/*
+ * stm_skiplist_get: Look up a key. found is set to false if it is absent.
+ */
+bool stm_skiplist_get(transaction_t transaction, stm_skiplist_t *list, uint64_t key, void **value, bool *found) {
+    stm_skiplist_node_t *preds[STM_SKIPLIST_MAX_LEVEL], *succs[STM_SKIPLIST_MAX_LEVEL];
+    if(!skiplist_find(transaction, list, key, preds, succs))
+        return false;
+    *found = succs[0] != NULL && succs[0]->key == key;
+    return !*found || transaction_read(transaction, &succs[0]->value_atom, value);
+}
+
+
+/*
+ * stm_skiplist_put: Set the value for a key, inserting it if absent.
+ */
+bool stm_skiplist_put(transaction_t transaction, stm_skiplist_t *list, uint64_t key, void *value) {
+    stm_skiplist_node_t *preds[STM_SKIPLIST_MAX_LEVEL], *succs[STM_SKIPLIST_MAX_LEVEL];
+    if(!skiplist_find(transaction, list, key, preds, succs))
+        return false;
+    if(succs[0] != NULL && succs[0]->key == key)
+        return transaction_write(transaction, &succs[0]->value_atom, &value);
+
+    int height = skiplist_random_height();
+    stm_skiplist_node_t *node = skiplist_node_new(fresh(transaction, skiplist_node_bytes(height)),
+                                                  height, key, value);
+    for(int level = 0; level < height; level++) {
+        node->next[level] = succs[level];
+        if(!transaction_write(transaction, &preds[level]->next_atoms[level], &node))
+            return false;
+    }
+    return true;
+}
+
+
+/*
+ * stm_skiplist_remove: Remove a key. removed is set to false if it was absent.
+ */
+bool stm_skiplist_remove(transaction_t transaction, stm_skiplist_t *list, uint64_t key, bool *removed) {
+    stm_skiplist_node_t *preds[STM_SKIPLIST_MAX_LEVEL], *succs[STM_SKIPLIST_MAX_LEVEL], *next;
+    if(!skiplist_find(transaction, list, key, preds, succs))
+        return false;
+    stm_skiplist_node_t *node = succs[0];
+    *removed = node != NULL && node->key == key;
+    if(!*removed)
+        return true;
+    for(int level = 0; level < node->height; level++) {
+        if(!transaction_read(transaction, &node->next_atoms[level], &next)
+                || !transaction_write(transaction, &preds[level]->next_atoms[level], &next))
+            return false;
+    }
+    retire(transaction, &list->retired, node);
+    return true;
+}
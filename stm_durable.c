@@ -0,0 +1,540 @@
+/*
+ * File: stm_durable.c
+ *
+ * Durable atoms: a privately mapped heap file whose writes are made
+ * persistent through a memory-mapped redo log with group commit, and
+ * written back to the file at checkpoints.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <glib.h>
+#include "stm.h"
+
+
+#define HEAP_MAGIC 0x53544d4845415031ULL  // "STMHEAP1"
+#define LOG_MAGIC 0x53544d4c4f473031ULL   // "STMLOG01"
+#define HEAP_ALIGN 16
+#define LOG_ALIGN 8
+
+#define LOG_WRITE 1
+#define LOG_COMMIT 2
+
+
+/*
+ * heap_header_t: Start of the heap file. Allocations follow it.
+ */
+typedef struct {
+    uint64_t magic;
+    uint64_t size;
+    uint64_t used;         // Offset of the first unallocated byte.
+    uint64_t root_offset;  // Zero until stm_durable_root is first called.
+} heap_header_t;
+
+
+/*
+ * log_header_t: Start of the log file.
+ *
+ * The generation is bumped whenever the log is emptied, so records left
+ * over from an older generation are ignored by replay without zeroing them.
+ */
+typedef struct {
+    uint64_t magic;
+    uint64_t generation;
+} log_header_t;
+
+
+/*
+ * log_record_t: Header of one redo log record.
+ *
+ * A LOG_WRITE record is followed by length bytes to store at offset in the heap.
+ * A LOG_COMMIT record ends a transaction; its offset field holds a checksum of
+ * the transaction's write records, so a torn flush is never replayed.
+ */
+typedef struct {
+    uint64_t generation;
+    uint32_t type;
+    uint32_t length;
+    uint64_t offset;
+} log_record_t;
+
+
+static char *_heap_base = NULL;
+static size_t _heap_size;
+static int _heap_fd = -1;
+static pthread_mutex_t _heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t _page_size;
+static size_t _heap_pages;
+static uint64_t *_heap_dirty;     // One bit per heap page written since its last sync.
+
+static char *_log_base = NULL;
+static size_t _log_size;
+static int _log_fd = -1;
+static size_t _log_tail;          // File offset of the next record.
+static size_t _log_flush_from;    // File offset of the first unflushed byte.
+static uint64_t _log_appended;    // Bytes ever appended; doubles as the LSN.
+static uint64_t _log_flushed;     // Bytes ever made durable.
+static int _log_inflight;         // Logged transactions not yet applied to the heap.
+static bool _log_flushing;        // Whether a thread is leading a group flush.
+static pthread_mutex_t _log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _log_flushed_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t _log_applied_cond = PTHREAD_COND_INITIALIZER;
+
+
+// Helper functions
+
+
+static size_t align_up(size_t n, size_t align) {
+    return (n + align - 1) & ~(align - 1);
+}
+
+
+/*
+ * checksum: FNV-1a over a byte range, continuing from a previous value.
+ */
+static uint64_t checksum(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for(size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+/*
+ * sync_range: msync a byte range of a mapping, widening it to page bounds.
+ */
+static void sync_range(char *base, size_t from, size_t to) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start = from & ~(page - 1);
+    if(to > start)
+        msync(base + start, to - start, MS_SYNC);
+}
+
+
+/*
+ * mark_dirty: Note that a byte range of the heap has been written, so its
+ * pages are written back before the log is next emptied.
+ */
+static void mark_dirty(size_t from, size_t to) {
+    for(size_t page = from / _page_size; page * _page_size < to; page++)
+        __atomic_fetch_or(&_heap_dirty[page / 64], 1ULL << (page % 64), __ATOMIC_RELAXED);
+}
+
+
+/*
+ * write_back: Write a byte range of the heap mapping to the heap file.
+ */
+static void write_back(size_t from, size_t to) {
+    while(from < to) {
+        ssize_t written = pwrite(_heap_fd, _heap_base + from, to - from, from);
+        if(written <= 0) {
+            printf("Error: Could not write back durable heap");
+            exit(EXIT_FAILURE);
+        }
+        from += written;
+    }
+}
+
+
+/*
+ * sync_header: Write the heap header back to the heap file and sync it.
+ */
+static void sync_header() {
+    write_back(0, sizeof(heap_header_t));
+    fdatasync(_heap_fd);
+}
+
+
+/*
+ * sync_dirty: Write each run of dirty heap pages back to the heap file, mark
+ * them clean and sync the file.
+ */
+static void sync_dirty() {
+    size_t run_start = 0, run_end = 0;  // Pages waiting to be synced.
+    for(size_t word = 0; word * 64 < _heap_pages; word++) {
+        uint64_t bits = __atomic_exchange_n(&_heap_dirty[word], 0, __ATOMIC_RELAXED);
+        for(; bits != 0; bits &= bits - 1) {
+            size_t page = word * 64 + __builtin_ctzll(bits);
+            if(page != run_end) {
+                if(run_end > run_start)
+                    write_back(run_start * _page_size, MIN(run_end * _page_size, _heap_size));
+                run_start = page;
+            }
+            run_end = page + 1;
+        }
+    }
+    if(run_end > run_start)
+        write_back(run_start * _page_size, MIN(run_end * _page_size, _heap_size));
+    fdatasync(_heap_fd);
+}
+
+
+/*
+ * map_file: Open or create a file, grow it to the given size and map it with
+ * the given mmap flags. Files are never shrunk, as that would cut off heap
+ * data or log records not yet replayed, so a file already larger than size is
+ * refused. Returns NULL on failure.
+ */
+static char *map_file(const char *path, size_t size, int flags, int *fd_out) {
+    struct stat st;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0)
+        return NULL;
+    if(fstat(fd, &st) || (size_t) st.st_size > size
+            || ((size_t) st.st_size < size && ftruncate(fd, size))) {
+        close(fd);
+        return NULL;
+    }
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if(base == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    *fd_out = fd;
+    return base;
+}
+
+
+/*
+ * log_reset: Empty the log by moving to a new generation.
+ *
+ * The heap must already be synced. Assumes _log_lock is held or the log is
+ * not yet shared.
+ */
+static void log_reset() {
+    log_header_t *header = (log_header_t *) _log_base;
+    header->generation++;
+    sync_range(_log_base, 0, sizeof(log_header_t));
+    _log_tail = align_up(sizeof(log_header_t), LOG_ALIGN);
+    _log_flush_from = _log_tail;
+    _log_flushed = _log_appended;
+}
+
+
+/*
+ * log_replay: Apply every complete transaction in the log to the heap,
+ * then empty the log.
+ */
+static void log_replay() {
+    log_header_t *header = (log_header_t *) _log_base;
+    size_t pos = align_up(sizeof(log_header_t), LOG_ALIGN), txn_start = pos;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while(pos + sizeof(log_record_t) <= _log_size) {
+        log_record_t *record = (log_record_t *) (_log_base + pos);
+        size_t next = align_up(pos + sizeof(log_record_t) + record->length, LOG_ALIGN);
+        if(record->generation != header->generation || next > _log_size)
+            break;
+        if(record->type == LOG_WRITE) {
+            if(record->offset + record->length > _heap_size)
+                break;
+            hash = checksum(hash, record, next - pos);
+        } else if(record->type == LOG_COMMIT) {
+            if(record->offset != hash)
+                break;
+            // Transaction is complete, so redo its writes.
+            for(size_t cur = txn_start; cur < pos;) {
+                log_record_t *write = (log_record_t *) (_log_base + cur);
+                memcpy(_heap_base + write->offset, write + 1, write->length);
+                mark_dirty(write->offset, write->offset + write->length);
+                cur = align_up(cur + sizeof(log_record_t) + write->length, LOG_ALIGN);
+            }
+            txn_start = next;
+            hash = 0xcbf29ce484222325ULL;
+        } else {
+            break;
+        }
+        pos = next;
+    }
+
+    sync_dirty();
+    log_reset();
+}
+
+
+/*
+ * log_checkpoint: Make room in the log by waiting for every logged
+ * transaction to reach the heap, writing back the pages they wrote and
+ * emptying the log.
+ *
+ * Transactions may have been applied before their records were flushed, so
+ * the log is flushed before any of their pages reach the heap file.
+ *
+ * Assumes _log_lock is held.
+ */
+static void log_checkpoint() {
+    while(_log_inflight > 0 || _log_flushing)
+        pthread_cond_wait(&_log_applied_cond, &_log_lock);
+    sync_range(_log_base, _log_flush_from, _log_tail);
+    sync_dirty();
+    log_reset();
+    pthread_cond_broadcast(&_log_flushed_cond);
+}
+
+
+// Durable heap functions
+
+
+/*
+ * heap_alloc: Allocate zeroed memory from the heap, or return NULL if it is full.
+ *
+ * Assumes _heap_lock is held.
+ */
+static void *heap_alloc(size_t size) {
+    heap_header_t *header = (heap_header_t *) _heap_base;
+    void *result = NULL;
+    if(header->used + size <= _heap_size) {
+        result = _heap_base + header->used;
+        memset(result, 0, size);
+        mark_dirty(header->used, header->used + size);
+        header->used = align_up(header->used + size, HEAP_ALIGN);
+        sync_header();
+    }
+    return result;
+}
+
+
+/*
+ * stm_durable_open: Map the heap and redo log files, creating them if needed,
+ * and replay any transactions the log holds from a previous run.
+ *
+ * The heap is mapped privately, so its writes only reach the file when they
+ * are written back at checkpoints. Either file may be grown, but not shrunk. Returns a nonzero value on failure,
+ * including when a size is smaller than its existing file.
+ */
+int stm_durable_open(const char *heap_path, size_t heap_size, const char *log_path, size_t log_size) {
+    heap_header_t *heap_header;
+    log_header_t *log_header;
+
+    _heap_base = map_file(heap_path, heap_size, MAP_PRIVATE, &_heap_fd);
+    if(_heap_base == NULL)
+        return 1;
+    _log_base = map_file(log_path, log_size, MAP_SHARED, &_log_fd);
+    if(_log_base == NULL) {
+        munmap(_heap_base, heap_size);
+        close(_heap_fd);
+        _heap_base = NULL;
+        return 1;
+    }
+    _heap_size = heap_size;
+    _log_size = log_size;
+    _page_size = (size_t) sysconf(_SC_PAGESIZE);
+    _heap_pages = (heap_size + _page_size - 1) / _page_size;
+    _heap_dirty = g_new0(uint64_t, (_heap_pages + 63) / 64);
+
+    heap_header = (heap_header_t *) _heap_base;
+    if(heap_header->magic != HEAP_MAGIC) {
+        heap_header->magic = HEAP_MAGIC;
+        heap_header->used = align_up(sizeof(heap_header_t), HEAP_ALIGN);
+        heap_header->root_offset = 0;
+    }
+    heap_header->size = heap_size;  // Never below the old size, as the file was not shrunk.
+    sync_header();
+
+    log_header = (log_header_t *) _log_base;
+    if(log_header->magic != LOG_MAGIC) {
+        log_header->magic = LOG_MAGIC;
+        log_header->generation = 0;
+    }
+    _log_appended = _log_flushed = 0;
+    _log_inflight = 0;
+    _log_flushing = false;
+    log_replay();
+    return 0;
+}
+
+
+/*
+ * stm_durable_close: Write back and unmap the heap, then empty and unmap the log.
+ *
+ * No transactions may be running.
+ */
+void stm_durable_close() {
+    if(_heap_base == NULL)
+        return;
+    sync_dirty();
+    log_reset();
+    munmap(_heap_base, _heap_size);
+    munmap(_log_base, _log_size);
+    close(_heap_fd);
+    close(_log_fd);
+    g_free(_heap_dirty);
+    _heap_base = _log_base = NULL;
+    _heap_dirty = NULL;
+}
+
+
+/*
+ * stm_durable_alloc: Allocate zeroed memory from the durable heap.
+ *
+ * Memory is never freed. The heap may be mapped at a different address after
+ * a restart, so persistent links between objects should be stored as offsets
+ * from stm_durable_root. Returns NULL if the heap is full.
+ */
+void *stm_durable_alloc(size_t size) {
+    pthread_mutex_lock(&_heap_lock);
+    void *result = heap_alloc(size);
+    pthread_mutex_unlock(&_heap_lock);
+    return result;
+}
+
+
+/*
+ * stm_durable_root: Get the heap's root object, allocating it with the given
+ * size the first time the heap is used. Later runs get the same object back.
+ *
+ * Threads calling this at once all get the same root.
+ */
+void *stm_durable_root(size_t size) {
+    heap_header_t *header = (heap_header_t *) _heap_base;
+    char *result = NULL;
+    pthread_mutex_lock(&_heap_lock);
+    if(header->root_offset == 0) {
+        char *root = heap_alloc(size);
+        if(root != NULL) {
+            header->root_offset = root - _heap_base;
+            sync_header();
+        }
+    }
+    if(header->root_offset != 0)
+        result = _heap_base + header->root_offset;
+    pthread_mutex_unlock(&_heap_lock);
+    return result;
+}
+
+
+/*
+ * stm_durable_contains: Whether an address lies within the durable heap.
+ */
+bool stm_durable_contains(void *address) {
+    return _heap_base != NULL && (char *) address >= _heap_base
+        && (char *) address < _heap_base + _heap_size;
+}
+
+
+// Redo log functions, used by transaction_commit
+
+
+/*
+ * _stm_durable_log: Append the durable writes of a locked, validated write set
+ * to the redo log, followed by a commit record. The heap pages they will
+ * change are marked dirty for the next checkpoint.
+ *
+ * Returns the LSN to pass to _stm_durable_applied and _stm_durable_wait,
+ * or 0 if nothing was logged.
+ */
+uint64_t _stm_durable_log(writeset_t *writeset) {
+    size_t needed = 0, pos;
+    uint64_t hash = 0xcbf29ce484222325ULL, generation, lsn;
+    GSList *in_order = NULL, *current;
+
+    if(_heap_base == NULL)
+        return 0;
+    // Log writes in the order writeset_commit applies them to each atom.
+    for(current = writeset->atom_list; current != NULL; current = current->next) {
+        if(stm_durable_contains(((atom_t *) current->data)->address))
+            in_order = g_slist_concat(writeset_atom_ops(writeset, current->data), in_order);
+    }
+    for(current = in_order; current != NULL; current = current->next)
+        needed += align_up(sizeof(log_record_t) + ((write_op_t *) current->data)->src_size, LOG_ALIGN);
+    if(needed == 0)
+        return 0;
+    needed += sizeof(log_record_t);
+    if(needed > _log_size - align_up(sizeof(log_header_t), LOG_ALIGN)) {
+        printf("Error: Transaction too large for durable log");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&_log_lock);
+    while(_log_tail + needed > _log_size)
+        log_checkpoint();
+    generation = ((log_header_t *) _log_base)->generation;
+    pos = _log_tail;
+    for(current = in_order; current != NULL; current = current->next) {
+        write_op_t *op = (write_op_t *) current->data;
+        log_record_t *record = (log_record_t *) (_log_base + pos);
+        size_t next = align_up(pos + sizeof(log_record_t) + op->src_size, LOG_ALIGN);
+        record->generation = generation;
+        record->type = LOG_WRITE;
+        record->length = op->src_size;
+        record->offset = (char *) op->atom->address - _heap_base + op->offset;
+        memcpy(record + 1, op->src, op->src_size);
+        mark_dirty(record->offset, record->offset + record->length);
+        hash = checksum(hash, record, next - pos);
+        pos = next;
+    }
+    log_record_t *commit = (log_record_t *) (_log_base + pos);
+    commit->generation = generation;
+    commit->type = LOG_COMMIT;
+    commit->length = 0;
+    commit->offset = hash;
+
+    _log_tail = pos + sizeof(log_record_t);
+    _log_appended += needed;
+    lsn = _log_appended;
+    _log_inflight++;
+    pthread_mutex_unlock(&_log_lock);
+    g_slist_free(in_order);
+    return lsn;
+}
+
+
+/*
+ * _stm_durable_applied: Note that a logged transaction's writes have reached
+ * the heap mapping, so a checkpoint may proceed.
+ *
+ * May be called before _stm_durable_wait: checkpoints flush the log before
+ * writing the heap file, so the file never holds writes the log could lose.
+ */
+void _stm_durable_applied(uint64_t lsn) {
+    if(lsn == 0)
+        return;
+    pthread_mutex_lock(&_log_lock);
+    if(--_log_inflight == 0)
+        pthread_cond_broadcast(&_log_applied_cond);
+    pthread_mutex_unlock(&_log_lock);
+}
+
+
+/*
+ * _stm_durable_wait: Block until the log is durable up to lsn.
+ *
+ * The first thread to arrive leads a flush of everything appended so far;
+ * threads arriving during it wait and are usually covered by it, so many
+ * commits share each msync.
+ */
+void _stm_durable_wait(uint64_t lsn) {
+    if(lsn == 0)
+        return;
+    pthread_mutex_lock(&_log_lock);
+    while(_log_flushed < lsn) {
+        if(_log_flushing) {
+            pthread_cond_wait(&_log_flushed_cond, &_log_lock);
+            continue;
+        }
+        size_t from = _log_flush_from, to = _log_tail;
+        uint64_t target = _log_appended;
+        _log_flushing = true;
+        pthread_mutex_unlock(&_log_lock);
+        sync_range(_log_base, from, to);
+        pthread_mutex_lock(&_log_lock);
+        _log_flushing = false;
+        _log_flush_from = to;
+        if(target > _log_flushed)
+            _log_flushed = target;
+        pthread_cond_broadcast(&_log_flushed_cond);
+        pthread_cond_broadcast(&_log_applied_cond);
+    }
+    pthread_mutex_unlock(&_log_lock);
+}
@@ -0,0 +1,79 @@
+/*
+ * File: tests/test_adaptive.c
+ *
+ * Checks that the adaptive controller only tunes backoff, and that aborted
+ * and abandoned transactions never hold up its quiescent point.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include "../stm.h"
+
+
+#define NUM_THREADS 4
+#define NUM_INCREMENTS 2000
+
+
+static int counter;
+static atom_t counter_atom;
+
+
+static void test_ended_transactions_leave() {
+    stm_stats_t before = stm_get_stats();
+    stm_adaptive_enable(1, NULL);
+    for(int i = 0; i < 20; i++) {
+        transaction_abort(transaction_new("abort"));
+        assert(transaction_commit(transaction_new("commit")) == 0);
+    }
+    usleep(2000);
+    // Samples the interval above, in which half of all transactions aborted.
+    transaction_abandon(transaction_new("sample"));
+    assert(_stm_backoff_us > 0);
+    usleep(2000);
+    // Would wait forever had the abandoned transaction not ended.
+    transaction_abandon(transaction_new("again"));
+    stm_adaptive_disable();
+
+    stm_stats_t after = stm_get_stats();
+    assert(after.aborts - before.aborts == 20);
+    assert(after.commits - before.commits == 20);
+    _stm_backoff_us = 0;
+}
+
+
+static void *increment(void *arg) {
+    for(int i = 0; i < NUM_INCREMENTS; i++) {
+        int value;
+        StartTransaction(trans);
+        ReadAtom(counter_atom, &value, int, trans);
+        value++;
+        WriteAtom(counter_atom, &value, int, trans);
+        EndTransaction(trans);
+    }
+    return NULL;
+}
+
+
+static void test_contended_switches() {
+    pthread_t threads[NUM_THREADS];
+    counter_atom = atomize(&counter, sizeof(int));
+    stm_adaptive_enable(1, NULL);
+    for(int i = 0; i < NUM_THREADS; i++)
+        pthread_create(&threads[i], NULL, increment, NULL);
+    for(int i = 0; i < NUM_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    stm_adaptive_disable();
+    assert(counter == NUM_THREADS * NUM_INCREMENTS);
+}
+
+
+int main() {
+    alarm(60);  // A quiescent point that never comes hangs rather than fails.
+    stm_init();
+    test_ended_transactions_leave();
+    test_contended_switches();
+    printf("test_adaptive: ok\n");
+    return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * File: tests/test_containers.c
+ *
+ * Round trips through each container, then concurrent churn to check that
+ * retired nodes are freed while the containers are still in use.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include "../stm.h"
+
+
+#define NUM_KEYS 1000
+#define NUM_THREADS 4
+#define NUM_ROUNDS 2000
+
+
+static void test_counter() {
+    stm_counter_t *counter = stm_counter_new(4);
+    long total;
+    for(int i = 1; i <= 10; i++) {
+        StartTransaction(add);
+        StmOp(stm_counter_add, add, counter, i);
+        EndTransaction(add);
+    }
+    StartTransaction(get);
+    StmOp(stm_counter_get, get, counter, &total);
+    EndTransaction(get);
+    assert(total == 55);
+    stm_counter_free(counter);
+}
+
+
+static void test_queue() {
+    stm_queue_t *queue = stm_queue_new();
+    void *value;
+    bool found;
+    for(int i = 1; i <= NUM_KEYS; i++) {
+        StartTransaction(push);
+        StmOp(stm_queue_push, push, queue, GINT_TO_POINTER(i));
+        EndTransaction(push);
+    }
+    for(int i = 1; i <= NUM_KEYS; i++) {
+        StartTransaction(pop);
+        StmOp(stm_queue_pop, pop, queue, &value, &found);
+        EndTransaction(pop);
+        assert(found && GPOINTER_TO_INT(value) == i);
+    }
+    StartTransaction(empty);
+    StmOp(stm_queue_pop, empty, queue, &value, &found);
+    EndTransaction(empty);
+    assert(!found);
+    // Popped nodes were freed as they became unreachable, not kept until now.
+    assert(g_queue_get_length(queue->retired.pnts) < NUM_KEYS);
+    stm_queue_free(queue);
+}
+
+
+static void test_map() {
+    stm_map_t *map = stm_map_new(4);  // Small enough that inserts resize it.
+    void *value;
+    bool found, removed;
+    long size;
+    for(uint64_t key = 0; key < NUM_KEYS; key++) {
+        StartTransaction(put);
+        StmOp(stm_map_put, put, map, key, GINT_TO_POINTER(key + 1));
+        EndTransaction(put);
+    }
+    assert(map->table->num_buckets > 4);
+    for(uint64_t key = 0; key < NUM_KEYS; key += 2) {
+        StartTransaction(update);
+        StmOp(stm_map_put, update, map, key, GINT_TO_POINTER(key + 2));
+        StmOp(stm_map_remove, update, map, key + 1, &removed);
+        EndTransaction(update);
+        assert(removed);
+    }
+    for(uint64_t key = 0; key < NUM_KEYS; key++) {
+        StartTransaction(get);
+        StmOp(stm_map_get, get, map, key, &value, &found);
+        EndTransaction(get);
+        assert(found == (key % 2 == 0));
+        assert(!found || GPOINTER_TO_INT(value) == (int) key + 2);
+    }
+    StartTransaction(count);
+    StmOp(stm_map_size, count, map, &size);
+    EndTransaction(count);
+    assert(size == NUM_KEYS / 2);
+    stm_map_free(map);
+}
+
+
+static void test_skiplist() {
+    stm_skiplist_t *list = stm_skiplist_new();
+    void *value;
+    bool found, removed;
+    // Keys go in out of order, then every third is removed.
+    for(uint64_t i = 0; i < NUM_KEYS; i++) {
+        uint64_t key = (i * 7919) % NUM_KEYS;
+        StartTransaction(put);
+        StmOp(stm_skiplist_put, put, list, key, GINT_TO_POINTER(key + 1));
+        EndTransaction(put);
+    }
+    for(uint64_t key = 0; key < NUM_KEYS; key += 3) {
+        StartTransaction(remove);
+        StmOp(stm_skiplist_remove, remove, list, key, &removed);
+        EndTransaction(remove);
+        assert(removed);
+    }
+    for(uint64_t key = 0; key < NUM_KEYS; key++) {
+        StartTransaction(get);
+        StmOp(stm_skiplist_get, get, list, key, &value, &found);
+        EndTransaction(get);
+        assert(found == (key % 3 != 0));
+        assert(!found || GPOINTER_TO_INT(value) == (int) key + 1);
+    }
+    // The bottom level stays in key order.
+    for(stm_skiplist_node_t *node = list->head->next[0]; node != NULL; node = node->next[0])
+        assert(node->next[0] == NULL || node->key < node->next[0]->key);
+    stm_skiplist_free(list);
+}
+
+
+static stm_queue_t *shared_queue;
+static stm_map_t *shared_map;
+
+
+static void *churn(void *arg) {
+    uint64_t base = (uint64_t) GPOINTER_TO_INT(arg) * NUM_ROUNDS;
+    for(int i = 0; i < NUM_ROUNDS; i++) {
+        void *value;
+        bool found, removed;
+        StartTransaction(trans);
+        StmOp(stm_queue_push, trans, shared_queue, GINT_TO_POINTER(i + 1));
+        StmOp(stm_queue_pop, trans, shared_queue, &value, &found);
+        StmOp(stm_map_put, trans, shared_map, base + i, value);
+        if(i > 0)
+            StmOp(stm_map_remove, trans, shared_map, base + i - 1, &removed);
+        EndTransaction(trans);
+        assert(found);
+    }
+    return NULL;
+}
+
+
+static void test_concurrent_churn() {
+    pthread_t threads[NUM_THREADS];
+    long size;
+    shared_queue = stm_queue_new();
+    shared_map = stm_map_new(1);
+    for(int i = 0; i < NUM_THREADS; i++)
+        pthread_create(&threads[i], NULL, churn, GINT_TO_POINTER(i));
+    for(int i = 0; i < NUM_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    StartTransaction(count);
+    StmOp(stm_map_size, count, shared_map, &size);
+    EndTransaction(count);
+    assert(size == NUM_THREADS);
+    assert(g_queue_get_length(shared_queue->retired.pnts) < NUM_THREADS * NUM_ROUNDS);
+    stm_queue_free(shared_queue);
+    stm_map_free(shared_map);
+}
+
+
+int main() {
+    stm_init();
+    test_counter();
+    test_queue();
+    test_map();
+    test_skiplist();
+    test_concurrent_churn();
+    printf("test_containers: ok\n");
+    return 0;
+}
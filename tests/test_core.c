@@ -0,0 +1,123 @@
+/*
+ * File: tests/test_core.c
+ *
+ * Single-threaded checks of reading, writing, committing and aborting.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "../stm.h"
+
+
+typedef struct {
+    atom_t *atom;
+    int value;
+} conflict_t;
+
+
+static void *commit_conflict(void *arg) {
+    conflict_t *conflict = (conflict_t *) arg;
+    transaction_t trans = transaction_new("conflict");
+    assert(transaction_write(trans, conflict->atom, &conflict->value));
+    assert(transaction_commit(trans) == 0);
+    return NULL;
+}
+
+
+/*
+ * write_from_thread: Commit a write to an atom from another thread, as a
+ * thread must not start a transaction while it has one open.
+ */
+static void write_from_thread(atom_t *atom, int value) {
+    pthread_t thread;
+    conflict_t conflict = {atom, value};
+    pthread_create(&thread, NULL, commit_conflict, &conflict);
+    pthread_join(thread, NULL);
+}
+
+
+static void test_commit_writes() {
+    int x = 1, seen = 0, value = 5;
+    atom_t atom = atomize(&x, sizeof(int));
+
+    transaction_t trans = transaction_new("commit");
+    assert(transaction_read(trans, &atom, &seen) && seen == 1);
+    assert(transaction_write(trans, &atom, &value));
+    assert(trans.readset->num_read_ops == 1 && trans.writeset->num_write_ops == 1);
+    value = 6;  // The write was copied into the log.
+    assert(transaction_read(trans, &atom, &seen) && seen == 5);
+    assert(x == 1);  // Nothing is written before commit.
+    assert(transaction_commit(trans) == 0);
+
+    assert(x == 5);
+    assert(atom_get_version(atom) > 0);
+}
+
+
+static void test_abort_discards_writes() {
+    int x = 1, value = 7;
+    atom_t atom = atomize(&x, sizeof(int));
+
+    transaction_t trans = transaction_new("abort");
+    assert(transaction_write(trans, &atom, &value));
+    transaction_abort(trans);
+    assert(x == 1);
+    assert(atom_get_version(atom) == 0);
+}
+
+
+static void test_conflicting_commit_fails() {
+    int x = 1, seen;
+    atom_t atom = atomize(&x, sizeof(int));
+
+    transaction_t reader = transaction_new("reader");
+    assert(transaction_read(reader, &atom, &seen));
+    write_from_thread(&atom, 2);
+
+    // The reader saw a version that is now stale.
+    assert(transaction_write(reader, &atom, &seen) == false);
+    assert(transaction_commit(reader) != 0);
+    transaction_abort(reader);
+    assert(x == 2);
+
+    // Reads of atoms newer than the transaction fail straight away.
+    transaction_t late = transaction_new("late");
+    write_from_thread(&atom, 3);
+    assert(transaction_read(late, &atom, &seen) == false);
+    transaction_abort(late);
+}
+
+
+static void test_mismatched_size_exits() {
+    long x = 0;
+    short value = 1;
+    atom_t atom = atomize(&x, sizeof(long));
+
+    // A short written to a long atom must not become a partial write.
+    pid_t pid = fork();
+    if(pid == 0) {
+        freopen("/dev/null", "w", stdout);
+        StartTransaction(trans);
+        WriteAtom(atom, &value, short, trans);
+        EndTransaction(trans);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE);
+    assert(x == 0);
+}
+
+
+int main() {
+    stm_init();
+    test_commit_writes();
+    test_abort_discards_writes();
+    test_conflicting_commit_fails();
+    test_mismatched_size_exits();
+    printf("test_core: ok\n");
+    return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * File: tests/test_durable.c
+ *
+ * Checks that transactions committed by a process that exits without closing
+ * the durable heap are recovered from the redo log.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "../stm.h"
+
+
+#define HEAP_SIZE (1 << 20)
+#define LOG_SIZE (1 << 16)
+#define SMALL_LOG_SIZE 4096  // Small enough that commits keep checkpointing.
+#define ROOT_OFFSET_FIELD 24  // root_offset is the fourth field of the heap header.
+#define NUM_THREADS 4
+#define NUM_INCREMENTS 500
+
+
+typedef struct {
+    long first;
+    long second;
+} pair_t;
+
+
+static char heap_path[64], log_path[64];
+
+
+/*
+ * commit_and_crash: In a child process, commit a whole write and then a
+ * field write to the root, then exit without closing the heap.
+ */
+static void commit_and_crash(long first, long second) {
+    pid_t pid = fork();
+    if(pid == 0) {
+        assert(stm_durable_open(heap_path, HEAP_SIZE, log_path, LOG_SIZE) == 0);
+        pair_t *root = stm_durable_root(sizeof(pair_t)), value = {first, 0};
+        atom_t atom = atomize(root, sizeof(pair_t));
+        StartTransaction(whole);
+        WriteAtom(atom, &value, pair_t, whole);
+        EndTransaction(whole);
+        StartTransaction(field);
+        WriteAtomField(atom, pair_t, second, &second, field);
+        EndTransaction(field);
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+
+/*
+ * lose_heap_writes: Overwrite the root in the heap file, as if the child's
+ * heap pages never reached the disk. Only the log can restore it.
+ */
+static void lose_heap_writes() {
+    uint64_t root_offset;
+    pair_t garbage = {-1, -1};
+    int fd = open(heap_path, O_RDWR);
+    assert(fd >= 0);
+    assert(pread(fd, &root_offset, sizeof(root_offset), ROOT_OFFSET_FIELD) == sizeof(root_offset));
+    assert(root_offset != 0);
+    assert(pwrite(fd, &garbage, sizeof(garbage), root_offset) == sizeof(garbage));
+    close(fd);
+}
+
+
+static pair_t read_root() {
+    pair_t *root = stm_durable_root(sizeof(pair_t));
+    assert(root != NULL);
+    return *root;
+}
+
+
+static void test_replay_after_exit() {
+    commit_and_crash(1, 2);
+    lose_heap_writes();
+    assert(stm_durable_open(heap_path, HEAP_SIZE, log_path, LOG_SIZE) == 0);
+    pair_t root = read_root();
+    assert(root.first == 1 && root.second == 2);
+    stm_durable_close();
+}
+
+
+static void test_replay_after_restart() {
+    // The log left by the last crash was emptied when it was replayed.
+    commit_and_crash(3, 4);
+    lose_heap_writes();
+    assert(stm_durable_open(heap_path, HEAP_SIZE, log_path, LOG_SIZE) == 0);
+    pair_t root = read_root();
+    assert(root.first == 3 && root.second == 4);
+    stm_durable_close();
+
+    // Closing syncs the heap, so nothing is lost without the log.
+    unlink(log_path);
+    assert(stm_durable_open(heap_path, HEAP_SIZE, log_path, LOG_SIZE) == 0);
+    root = read_root();
+    assert(root.first == 3 && root.second == 4);
+    stm_durable_close();
+}
+
+
+static void test_refuse_shrinking() {
+    // Smaller sizes would cut off the root and the log records that restore it.
+    commit_and_crash(5, 6);
+    assert(stm_durable_open(heap_path, HEAP_SIZE / 2, log_path, LOG_SIZE) != 0);
+    assert(stm_durable_open(heap_path, HEAP_SIZE, log_path, LOG_SIZE / 2) != 0);
+    lose_heap_writes();
+    assert(stm_durable_open(heap_path, HEAP_SIZE, log_path, LOG_SIZE) == 0);
+    pair_t root = read_root();
+    assert(root.first == 5 && root.second == 6);
+    stm_durable_close();
+}
+
+
+static void *increment(void *arg) {
+    atom_t *atom = (atom_t *) arg;
+    for(int i = 0; i < NUM_INCREMENTS; i++) {
+        long value;
+        StartTransaction(trans);
+        ReadAtom(*atom, &value, long, trans);
+        value++;
+        WriteAtom(*atom, &value, long, trans);
+        EndTransaction(trans);
+    }
+    return NULL;
+}
+
+
+static void test_concurrent_checkpoints() {
+    pthread_t threads[NUM_THREADS];
+    atom_t atoms[NUM_THREADS];
+    unlink(heap_path);
+    unlink(log_path);
+    assert(stm_durable_open(heap_path, HEAP_SIZE, log_path, SMALL_LOG_SIZE) == 0);
+    // One counter per thread, a page apart, and one they all share.
+    char *counters = stm_durable_root(NUM_THREADS * 4096 + sizeof(long));
+    atom_t shared = atomize(counters + NUM_THREADS * 4096, sizeof(long));
+    for(int i = 0; i < NUM_THREADS; i++) {
+        atoms[i] = atomize(counters + i * 4096, sizeof(long));
+        pthread_create(&threads[i], NULL, increment, i % 2 ? &shared : &atoms[i]);
+    }
+    for(int i = 0; i < NUM_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    stm_durable_close();
+
+    assert(stm_durable_open(heap_path, HEAP_SIZE, log_path, SMALL_LOG_SIZE) == 0);
+    counters = stm_durable_root(0);
+    for(int i = 0; i < NUM_THREADS; i += 2)
+        assert(*(long *) (counters + i * 4096) == NUM_INCREMENTS);
+    assert(*(long *) (counters + NUM_THREADS * 4096) == NUM_THREADS / 2 * NUM_INCREMENTS);
+    stm_durable_close();
+}
+
+
+int main() {
+    stm_init();
+    snprintf(heap_path, sizeof(heap_path), "/tmp/stm_test_heap.%d", (int) getpid());
+    snprintf(log_path, sizeof(log_path), "/tmp/stm_test_log.%d", (int) getpid());
+    test_replay_after_exit();
+    test_replay_after_restart();
+    test_refuse_shrinking();
+    test_concurrent_checkpoints();
+    unlink(heap_path);
+    unlink(log_path);
+    printf("test_durable: ok\n");
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * File: tests/test_hooks.c
+ *
+ * Checks that commit and abort hooks all run, once each, in registration order,
+ * and that a flush hook runs once per batch of commits.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include "../stm.h"
+
+
+static int ran[16];
+static int num_ran;
+
+
+static void record(void *arg) {
+    ran[num_ran++] = GPOINTER_TO_INT(arg);
+}
+
+
+static void expect(const int *values, int num_values) {
+    assert(num_ran == num_values);
+    for(int i = 0; i < num_values; i++)
+        assert(ran[i] == values[i]);
+    num_ran = 0;
+}
+
+
+typedef struct {
+    atom_t *atom;
+    int value;
+} conflict_t;
+
+
+static void *commit_conflict(void *arg) {
+    conflict_t *conflict = (conflict_t *) arg;
+    transaction_t trans = transaction_new("conflict");
+    assert(transaction_write(trans, conflict->atom, &conflict->value));
+    assert(transaction_commit(trans) == 0);
+    return NULL;
+}
+
+
+/*
+ * write_from_thread: Commit a write to an atom from another thread, as a
+ * thread must not start a transaction while it has one open.
+ */
+static void write_from_thread(atom_t *atom, int value) {
+    pthread_t thread;
+    conflict_t conflict = {atom, value};
+    pthread_create(&thread, NULL, commit_conflict, &conflict);
+    pthread_join(thread, NULL);
+}
+
+
+static void test_commit_hooks() {
+    StartTransaction(trans);
+    stm_on_commit(record, GINT_TO_POINTER(1), trans);
+    stm_on_abort(record, GINT_TO_POINTER(100), trans);
+    stm_on_commit(record, GINT_TO_POINTER(2), trans);
+    stm_on_commit(record, GINT_TO_POINTER(1), trans);  // Identical hooks both run.
+    EndTransaction(trans);
+    expect((int []) {1, 2, 1}, 3);
+}
+
+
+static void test_abort_hooks() {
+    int x = 0, seen;
+    atom_t atom = atomize(&x, sizeof(int));
+    volatile int attempts = 0;
+
+    StartTransaction(trans);
+    ReadAtom(atom, &seen, int, trans);
+    if(attempts++ == 0) {
+        stm_on_commit(record, GINT_TO_POINTER(1), trans);
+        stm_on_abort(record, GINT_TO_POINTER(10), trans);
+        stm_on_abort(record, GINT_TO_POINTER(11), trans);
+        // Invalidate the read, so this attempt fails to commit.
+        write_from_thread(&atom, 1);
+    } else {
+        stm_on_commit(record, GINT_TO_POINTER(3), trans);
+    }
+    EndTransaction(trans);
+
+    assert(attempts == 2);
+    expect((int []) {10, 11, 3}, 3);
+}
+
+
+static int num_flushes;
+static int flushed_up_to;
+
+
+/*
+ * flush: Flush hook, taking everything recorded by commit hooks so far.
+ */
+static void flush(void *arg) {
+    num_flushes++;
+    flushed_up_to = num_ran;
+}
+
+
+static void test_flush_hook() {
+    stm_on_flush(flush, NULL, 3);
+    for(int i = 0; i < 7; i++) {
+        StartTransaction(trans);
+        stm_on_commit(record, GINT_TO_POINTER(i), trans);
+        EndTransaction(trans);
+        // Commit hooks are never held back for the batch.
+        assert(num_ran == i + 1);
+        assert(num_flushes == (i + 1) / 3);
+    }
+    assert(flushed_up_to == 6);
+
+    // The last commit is flushed on demand, and only once.
+    stm_flush_hooks();
+    stm_flush_hooks();
+    assert(num_flushes == 3 && flushed_up_to == 7);
+    expect((int []) {0, 1, 2, 3, 4, 5, 6}, 7);
+
+    stm_on_flush(NULL, NULL, 0);
+    StartTransaction(trans);
+    EndTransaction(trans);
+    stm_flush_hooks();
+    assert(num_flushes == 3);
+}
+
+
+int main() {
+    stm_init();
+    test_commit_hooks();
+    test_abort_hooks();
+    test_flush_hook();
+    printf("test_hooks: ok\n");
+    return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * File: tests/test_range.c
+ *
+ * Checks that partial writes to an atom merge in order and only write back
+ * their own ranges.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "../stm.h"
+
+
+typedef struct {
+    int a;
+    long b;
+    char c[8];
+} record_t;
+
+
+static void test_field_round_trip() {
+    record_t record = {1, 2, "abcdefg"}, seen;
+    atom_t atom = atomize(&record, sizeof(record_t));
+    int a = 10, seen_a;
+    long seen_b;
+
+    StartTransaction(trans);
+    WriteAtomField(atom, record_t, a, &a, trans);
+    a = 11;  // The field was copied into the log.
+    ReadAtomField(atom, record_t, a, &seen_a, trans);
+    ReadAtomField(atom, record_t, b, &seen_b, trans);
+    assert(seen_a == 10 && seen_b == 2);
+    ReadAtom(atom, &seen, record_t, trans);
+    assert(seen.a == 10 && seen.b == 2 && strcmp(seen.c, "abcdefg") == 0);
+    assert(record.a == 1);
+    // Only the written field goes back at commit.
+    record.b = 3;
+    EndTransaction(trans);
+
+    assert(record.a == 10 && record.b == 3);
+}
+
+
+static void test_overlapping_ranges() {
+    char bytes[8] = "01234567", seen[8];
+    atom_t atom = atomize(bytes, sizeof(bytes));
+    transaction_t trans = transaction_new("overlap");
+
+    assert(transaction_write_range(trans, &atom, 0, "AAAA", 4));
+    assert(transaction_write_range(trans, &atom, 2, "BBBB", 4));
+    assert(transaction_read_range(trans, &atom, 0, seen, 8));
+    assert(memcmp(seen, "AABBBB67", 8) == 0);
+    assert(transaction_read_range(trans, &atom, 3, seen, 2));
+    assert(memcmp(seen, "BB", 2) == 0);
+    assert(transaction_commit(trans) == 0);
+    assert(memcmp(bytes, "AABBBB67", 8) == 0);
+}
+
+
+static void test_whole_and_field_writes() {
+    record_t record = {1, 2, "abcdefg"}, whole = {5, 6, "hijklmn"}, seen;
+    atom_t atom = atomize(&record, sizeof(record_t));
+    int a = 7;
+    long b = 8;
+
+    // A whole write replaces earlier field writes, and later ones apply over it.
+    StartTransaction(trans);
+    WriteAtomField(atom, record_t, b, &b, trans);
+    WriteAtom(atom, &whole, record_t, trans);
+    WriteAtomField(atom, record_t, a, &a, trans);
+    ReadAtom(atom, &seen, record_t, trans);
+    assert(seen.a == 7 && seen.b == 6 && strcmp(seen.c, "hijklmn") == 0);
+    EndTransaction(trans);
+
+    assert(record.a == 7 && record.b == 6 && strcmp(record.c, "hijklmn") == 0);
+}
+
+
+int main() {
+    stm_init();
+    test_field_round_trip();
+    test_overlapping_ranges();
+    test_whole_and_field_writes();
+    printf("test_range: ok\n");
+    return 0;
+}